@@ -7,12 +7,19 @@
  * 
  * The hash table has the following properties:
  * 
- *   - Uses the DJB2 hash function
+ *   - Uses the DJB2 hash function, a CRC32C based hash for long keys, or
+ *     SipHash with a secret per-dictionary seed when keys may be hostile
  *   - Collision resolution using open addressing
  *   - Preserves the order of keys by insertion by storing indexes to values in
  *     slots instead of the values themselves
- *   - Common case O(1) insert, update, retrieve, and member check
- *   - O(n) delete (makes deleting keys less complex with order-preserving)
+ *   - Slots are 1, 2, 4 or 8 bytes wide depending on the capacity, so small
+ *     dictionaries have small indexes and large ones can go past 4G entries
+ *   - Dictionaries with up to 8 entries (KH_TINY_DICT_SIZE, which can be
+ *     defined before including the header) have no slots at all and are
+ *     searched by scanning their pairs
+ *   - Common case O(1) insert, update, retrieve, member check and delete
+ *   - Deletes leave holes in the pairs which are closed up the next time the
+ *     slots are rebuilt, so the order of keys is kept without moving anything
  *   - Only supports power-of-two capacity sizes ATM
  * 
  * Some general usage notes:
@@ -49,27 +56,65 @@
  *   - Almost all functions take "ownership" of the blob you pass them, and use
  *     it internally or automatically free if it it's not used. If you want to
  *     pass a blob with the same value as a previous one, you will need to make
- *     a copy of it.
+ *     a copy of it, or retain it with KH_RetainBlob().
+ *   
+ *   - Blobs are reference counted. Each function which takes ownership of a
+ *     blob takes one reference, and releasing a blob drops one. The blob is
+ *     only freed once nobody refers to it anymore. Blobs are immutable, so it
+ *     is safe to share them between dictionaries, even on different threads.
  *   
  *   - KH_Blob *KH_CreateBlob(uint8_t *buffer, size_t length)
  *     
  *     Creates a new blob for use with hash table functions. Returns NULL if it
  *     fails to allocate memory.
+ *     
+ *     The blob's hash isn't computed until it is first used as a key, so blobs
+ *     that are only ever used as values never pay for hashing.
+ *   
+ *   - KH_Blob *KH_CreateBlobWith(KH_Allocator *allocator, uint8_t *buffer, size_t length)
+ *     
+ *     Same as KH_CreateBlob, but the blob's memory comes from the given
+ *     allocator (see "Custom allocators" below) and is returned to it when the
+ *     blob is released.
  *   
  *   - KH_Blob *KH_BlobForString(char *string)
  *     
  *     Creates a new blob from a NUL-terminated C string. Returns NULL if it
  *     fails to allocate memory.
  *   
+ *   - KH_Blob *KH_CreateBlobView(uint8_t *buffer, size_t length, KH_BlobReleaseFunc release, void *context)
+ *     
+ *     Creates a blob which refers to the given buffer instead of copying it,
+ *     for example a mmap'd file or a network buffer. The buffer must stay valid
+ *     and unchanged for as long as the blob is alive. Views can be used as keys
+ *     or values just like normal blobs.
+ *     
+ *     When the blob is released (by you or by the dictionary holding it),
+ *     release(context, buffer, length) is called if release isn't NULL, which
+ *     is where you can drop your own reference to the buffer. Pass NULL if the
+ *     buffer outlives every blob that refers to it. Returns NULL if it fails to
+ *     allocate memory.
+ *   
+ *   - KH_Blob *KH_CreateBlobViewWith(KH_Allocator *allocator, uint8_t *buffer, size_t length, KH_BlobReleaseFunc release, void *context)
+ *     
+ *     Same as KH_CreateBlobView, but the view's header comes from the given
+ *     allocator.
+ *   
+ *   - KH_Blob *KH_RetainBlob(KH_Blob *blob)
+ *     
+ *     Adds a reference to a blob and returns it, so it can be given to one
+ *     more function or dictionary without copying it.
+ *   
  *   - void KH_ReleaseBlob(KH_Blob *blob)
  *     
- *     Releases all resources associated with a blob. Normally, calling this
- *     function is unnessicary, since the hash table functions free blobs if
- *     they are not used later.
+ *     Drops a reference to a blob, and releases all resources associated with
+ *     it once there are none left. Normally, calling this function is
+ *     unnessicary, since the hash table functions free blobs if they are not
+ *     used later.
  *   
  *   - The blob structure has the following members:
  *     
- *     - data, an array of the bytes the blob contains
+ *     - data, a pointer to the bytes the blob contains
  *     - length, the length of the data the blob holds
  *     
  *     Acessing the blob structure directly is needed, since there are no
@@ -83,11 +128,100 @@
  *     
  *     Creates a new dictionary. Returns NULL if it fails.
  *   
+ *   - KH_Dict *KH_DictClone(KH_Dict *dict)
+ *     
+ *     Creates a copy of a dictionary with the same options and entries, by
+ *     copying its internal arrays directly. The keys and values are shared
+ *     with the original using their reference counts instead of being copied,
+ *     so changing either dictionary afterwards doesn't affect the other.
+ *     Returns NULL if it fails.
+ *   
+ *   - KH_Dict *KH_CreateDictWithOptions(KH_DictOptions *options)
+ *     
+ *     Creates a new dictionary with the given options, or the defaults if
+ *     options is NULL. Zero-initialise the options struct and set the members
+ *     you care about:
+ *     
+ *     - allocator, the allocator used for the dictionary itself, its slots and
+ *       pairs, and any blobs it creates internally (such as in
+ *       KH_DictSetBytes). NULL means malloc, realloc and free.
+ *     
+ *     - flags, any of the following OR'd together:
+ *       
+ *       - KH_DICT_ALIGNED, to align the slot and pair arrays to 64-byte cache
+ *         lines.
+ *       
+ *       - KH_DICT_HUGE_PAGES, to map slot and pair arrays of 2 MiB or more
+ *         directly, trying explicit huge pages (MAP_HUGETLB) first and then
+ *         transparent huge pages (MADV_HUGEPAGE). If neither works, on systems
+ *         other than Linux, or when compiled in a strict ISO C mode which hides
+ *         MAP_ANONYMOUS, the arrays come from the allocator as with
+ *         KH_DICT_ALIGNED. This cuts TLB misses on big tables.
+ *       
+ *       - KH_DICT_KEYED, to hash keys with SipHash-2-4 keyed by a per-dictionary
+ *         seed instead of DJB2. This is slower, but an attacker who doesn't
+ *         know the seed can't pick keys that collide.
+ *       
+ *       - KH_DICT_AUTO_SHRINK, to shrink the dictionary when deletes leave it
+ *         less than a quarter full. It shrinks to a size where it is half full,
+ *         so it won't thrash between two sizes.
+ *       
+ *       - KH_DICT_CRC32C, to hash keys with a hash built on CRC32C instead of
+ *         DJB2. It uses the SSE4.2 crc32 instruction when the CPU has it (found
+ *         out on first use) or the ARM CRC32 instructions when compiled for
+ *         them, and a table based version otherwise, which all give the same
+ *         hashes. With the instructions it's many times faster than DJB2 on
+ *         long keys like URLs. KH_DICT_KEYED takes priority over it.
+ *     
+ *     - seed, the SipHash seed used with KH_DICT_KEYED. If both halves are
+ *       zero, a random seed is used.
+ *     
+ *     - threads, the number of threads used to rebuild the slots of big
+ *       dictionaries (65536 entries or more, KH_PARALLEL_REHASH_MIN) when they
+ *       resize or rehash. This only does anything if KHASHTABLE_THREADS is
+ *       defined before including the implementation, which needs pthreads.
+ *       Zero or one means the slots are always rebuilt on the calling thread.
+ *     
+ *     Even without KH_DICT_KEYED, a dictionary which sees an insert needing a
+ *     pathologically long probe (which is what colliding keys cause) switches
+ *     itself to keyed hashing with a random seed and rehashes everything.
+ *     
+ *     Returns NULL if it fails.
+ *   
  *   - bool KH_DictSet(KH_Dict *dict, KH_Blob *key, KH_Blob *value)
  *     
  *     Sets the value associated with the key to the given value. Returns true
  *     on success, and false on failure.
  *   
+ *   - bool KH_DictSetBytes(KH_Dict *dict, uint8_t *key, size_t key_length, uint8_t *value, size_t value_length)
+ *     
+ *     Same as KH_DictSet, but takes plain buffers which are copied. If the key
+ *     is new, the key and value blobs are created in a single allocation that
+ *     the dictionary frees as a unit, and no allocation happens at all until
+ *     the key is known to be new. Returns true on success, and false on
+ *     failure.
+ *   
+ *   - KH_Blob **KH_DictGetOrInsert(KH_Dict *dict, KH_Blob *key, KH_Blob *value, bool *inserted)
+ *     
+ *     Returns a pointer to the value associated with the key, inserting the
+ *     given value first if there isn't one. The table is only probed once. If
+ *     the key already existed, both blobs passed in are freed. If inserted
+ *     isn't NULL, it's set to whether the key was newly inserted. Returns NULL
+ *     if it fails to allocate memory.
+ *     
+ *     The value may be NULL, which is a valid value to keep (sets keep
+ *     nothing else). KH_DictGet and KH_DictValueIter return NULL for such an
+ *     entry just as they do for a missing one, so iterate with KH_DictKeyIter
+ *     and use KH_DictHas to tell them apart. If you replace a value through
+ *     the returned pointer, you are responsible for releasing the old one. The
+ *     pointer is only valid until the next change to the dictionary.
+ *   
+ *   - KH_Blob **KH_DictUpsert(KH_Dict *dict, KH_Blob *key, KH_Blob *value, bool *inserted)
+ *     
+ *     Same as KH_DictSet, but returns a pointer to the stored value and sets
+ *     inserted (if not NULL) to whether the key was newly inserted. Returns
+ *     NULL if it fails to allocate memory.
+ *   
  *   - KH_Blob *KH_DictGet(KH_Dict *dict, KH_Blob *key)
  *     
  *     Gets the blob assocaited with the given key. The blob returned should be
@@ -105,6 +239,40 @@
  *     Delete the mapping assocaited with the given key. Returns true if
  *     successful, or false if not.
  *   
+ *   - bool KH_DictPopFirst(KH_Dict *dict, KH_Blob **key, KH_Blob **value)
+ *   - bool KH_DictPopLast(KH_Dict *dict, KH_Blob **key, KH_Blob **value)
+ *     
+ *     Remove the oldest or newest entry, so the dictionary can be used as a
+ *     queue or stack. The key and value are stored in *key and *value, and
+ *     are then yours to release; pass NULL for either to have it released
+ *     instead. Returns false if the dictionary is empty. Both take O(1) time,
+ *     amortised over the deletes for KH_DictPopFirst.
+ *   
+ *   - bool KH_DictUpdate(KH_Dict *dict, KH_Dict *other, bool move, KH_DictConflictFunc resolve, void *context)
+ *     
+ *     Sets every entry of other in dict, like calling KH_DictSet for each of
+ *     them but faster: dict is resized once up front, and the hashes stored
+ *     in other are reused when both dictionaries hash keys the same way.
+ *     
+ *     If move is false, the blobs are shared with other using their reference
+ *     counts and other is left as it was. If move is true, the blobs are moved
+ *     over and other is left empty.
+ *     
+ *     Entries keep their expiry times (see "Expiring entries"), and entries of
+ *     other which have already expired are left out.
+ *     
+ *     When a key is in both dictionaries, resolve(context, key, old_value,
+ *     new_value) is called and the new value is only taken if it returns
+ *     true. If resolve is NULL, the new value is always taken. Returns true on
+ *     success, and false if it fails to allocate memory, in which case
+ *     neither dictionary is changed.
+ *   
+ *   - void KH_DictClear(KH_Dict *dict)
+ *     
+ *     Removes every entry from the dictionary, releasing their blobs but
+ *     keeping the dictionary's memory, so it can be refilled to the same size
+ *     without allocating again.
+ *   
  *   - void KH_ReleaseDict(KH_Dict *dict)
  *     
  *     Releases all resources associated with a dictionary.
@@ -115,16 +283,313 @@
  *     
  *     Return the number of entries in the hash table.
  *   
+ *   - bool KH_DictReserve(KH_Dict *dict, size_t count)
+ *     
+ *     Make room for count entries in total, so that adding up to that many
+ *     won't resize the dictionary. Returns false if it fails to allocate
+ *     memory.
+ *   
+ *   - bool KH_DictShrinkToFit(KH_Dict *dict)
+ *     
+ *     Shrink the memory used by the dictionary to the smallest size which can
+ *     hold the entries it has now. Returns false if it fails to allocate
+ *     memory, in which case the dictionary is left as it was.
+ *   
  *   - KH_Blob *KH_DictKeyIter(KH_Dict *dict, size_t index)
  *     
  *     Return the key for the i-th key-value pair in the dictionary, or NULL
- *     if it would be out of bounds.
+ *     if it would be out of bounds. The first call after deleting entries
+ *     closes up the holes they left, which takes O(n) and counts as a change
+ *     to the dictionary.
  *   
  *   - KH_Blob *KH_DictValueIter(KH_Dict *dict, size_t index)
  *     
  *     Return the value for the i-th key-value pair in the dictionary, or NULL
  *     if it would be out of bounds.
  * 
+ * Expiring entries:
+ * 
+ *   - uint64_t KH_Now(void)
+ *     
+ *     Return the current time on the clock expiry times use, in nanoseconds.
+ *     It only ever goes forward, so add a duration to it to get an expiry
+ *     time: KH_Now() + 30 * 1000000000ull is thirty seconds from now.
+ *     
+ *     The clock is CLOCK_MONOTONIC where the headers declare it. Strict ISO C
+ *     modes (-std=c11 rather than gnu11) hide it, and then C23's
+ *     TIME_MONOTONIC is used if there is one, or else wall clock time, which
+ *     can jump backwards or forwards when the system clock is changed. Strict
+ *     C99 only has time(), so there the clock counts in whole seconds. The
+ *     latency histograms use the same clock.
+ *   
+ *   - bool KH_DictSetExpiring(KH_Dict *dict, KH_Blob *key, KH_Blob *value, uint64_t expires)
+ *     
+ *     Like KH_DictSet, but the entry expires once KH_Now() reaches expires, or
+ *     never if expires is zero. Returns false if it fails to allocate memory.
+ *   
+ *   - bool KH_DictExpire(KH_Dict *dict, KH_Blob *key, uint64_t expires)
+ *     
+ *     Change when an existing entry expires, or make it never expire if
+ *     expires is zero. Returns false if the key isn't in the dictionary (or
+ *     has already expired), or if it fails to allocate memory.
+ *   
+ *   - size_t KH_DictSweep(KH_Dict *dict, size_t budget)
+ *     
+ *     Remove expired entries, looking at no more than budget entries. Each
+ *     call carries on from where the last one stopped, so calling it now and
+ *     then with a small budget (from an event loop, say) reclaims all of them
+ *     without any one call taking long. Returns the number removed.
+ *   
+ *   Looking up, deleting or replacing an expired entry treats it as missing
+ *   and removes it then. Until that happens or it's swept, it still counts in
+ *   KH_DictLen and shows up when iterating. Setting a value any other way
+ *   (KH_DictSet, KH_DictUpsert and so on) makes the entry never expire, except
+ *   for KH_DictUpdate, which gives each entry it sets the expiry time it had
+ *   in the other dictionary and leaves out the ones that have expired.
+ *   Dictionaries only use memory for expiry times once an entry is given one.
+ *   
+ *   Expiry doesn't apply to caches; don't set it on a cache's dictionary.
+ * 
+ * Using the LRU cache:
+ * 
+ *   - KH_Cache *KH_CreateCache(KH_CacheOptions *options)
+ *     
+ *     Creates a dictionary which keeps its size within some limits by evicting
+ *     the least recently used entries, or NULL if it fails. Zero-initialise the
+ *     options struct and set the members you care about:
+ *     
+ *     - dict, the options for the dictionary holding the entries, see
+ *       KH_CreateDictWithOptions
+ *     - max_entries, the most entries the cache can hold, or zero for no limit
+ *     - max_bytes, the most bytes the keys and values can take up, counting
+ *       their lengths, or zero for no limit
+ *     - flags, any of the following OR'd together:
+ *       
+ *       - KH_CACHE_PROMOTE_ON_GET, to make KH_CacheGet count as a use;
+ *         otherwise only setting an entry counts
+ *       
+ *       - KH_CACHE_TINY_LFU, to decide what to keep by how often keys are used
+ *         instead of only how recently, see below
+ *     
+ *     The entries are kept in a normal dictionary, in order from least to most
+ *     recently used, so evicting and using entries are both O(1) and there is
+ *     no separate list to keep up to date. It can be read from with the
+ *     dictionary functions on cache->dict (iterating it gives the entries
+ *     oldest first), but must only be changed with the cache functions.
+ *   
+ *   - With KH_CACHE_TINY_LFU, every KH_CacheGet (hit or miss) and KH_CacheSet
+ *     counts a use of the key in a count-min sketch, which keeps eight 4-bit
+ *     counters per entry the cache holds (KH_SKETCH_COUNTERS) no matter how
+ *     many different keys it sees. The counters are halved every so often so
+ *     old popularity fades.
+ *     
+ *     When the cache is full, the victim is the least often used of the few
+ *     least recently used entries (KH_CACHE_SAMPLES, 5 by default), and a new
+ *     key is only let in if it has been used more often than the victim.
+ *     Otherwise KH_CacheSet drops it and returns false. The oldest entry is
+ *     moved to the back whenever it survives, so the ones behind it get looked
+ *     at too, which makes the order of the entries only roughly by recency.
+ *     
+ *     A scan through many keys that are each used once can't push out the
+ *     entries that are used all the time, as it would with plain LRU.
+ *   
+ *   - bool KH_CacheSet(KH_Cache *cache, KH_Blob *key, KH_Blob *value)
+ *     
+ *     Sets the value for the key and makes it the most recently used entry,
+ *     evicting as many entries as needed to stay within the limits. An entry
+ *     bigger than max_bytes on its own is not stored and removes any old value
+ *     for the key. Returns false if it wasn't stored.
+ *   
+ *   - KH_Blob *KH_CacheGet(KH_Cache *cache, KH_Blob *key)
+ *     
+ *     Gets the value for the key, or NULL if it isn't in the cache. The value
+ *     stays valid until the next change to the cache.
+ *   
+ *   - bool KH_CacheDelete(KH_Cache *cache, KH_Blob *key)
+ *     
+ *     Removes the key from the cache. Returns true if it was there.
+ *   
+ *   - size_t KH_CacheLen(KH_Cache *cache)
+ *     
+ *     Returns the number of entries in the cache. The total size of the keys
+ *     and values is in cache->bytes.
+ *   
+ *   - void KH_ReleaseCache(KH_Cache *cache)
+ *     
+ *     Releases the cache and all of its entries.
+ * 
+ * Using sets:
+ * 
+ *   - KH_Set *KH_CreateSet(KH_DictOptions *options)
+ *     
+ *     Creates a set of keys, or NULL if it fails. options may be NULL, and are
+ *     the same as for KH_CreateDictWithOptions. A set is a dictionary whose
+ *     values are all NULL, so there are no value blobs to make or free.
+ *   
+ *   - KH_Set *KH_SetClone(KH_Set *set)
+ *     
+ *     Returns a copy of the set, or NULL if it fails, sharing its keys.
+ *   
+ *   - bool KH_SetAdd(KH_Set *set, KH_Blob *key, bool *added)
+ *     
+ *     Adds a key to the set. If added isn't NULL, it's set to whether the key
+ *     wasn't in the set before. Returns false if it fails to allocate memory.
+ *   
+ *   - bool KH_SetHas(KH_Set *set, KH_Blob *key)
+ *   - bool KH_SetDelete(KH_Set *set, KH_Blob *key)
+ *   - KH_Blob *KH_SetIter(KH_Set *set, size_t index)
+ *   - size_t KH_SetLen(KH_Set *set)
+ *     
+ *     The same as KH_DictHas, KH_DictDelete, KH_DictKeyIter and KH_DictLen.
+ *   
+ *   - bool KH_SetUnion(KH_Set *set, KH_Set *other)
+ *     
+ *     Adds every key in other to set. Returns false if it fails to allocate
+ *     memory, in which case set is left as it was.
+ *   
+ *   - void KH_SetIntersection(KH_Set *set, KH_Set *other)
+ *     
+ *     Removes every key from set which isn't in other.
+ *   
+ *   - void KH_SetDifference(KH_Set *set, KH_Set *other)
+ *     
+ *     Removes every key from set which is in other.
+ *   
+ *   The set operations look keys up by the hashes already stored with them
+ *   when both sets hash keys the same way (neither is keyed, or both have the
+ *   same seed), so no key is hashed again. Use KH_SetClone first to keep the
+ *   original.
+ *   
+ *   - void KH_ReleaseSet(KH_Set *set)
+ *     
+ *     Releases the set and all of its keys.
+ * 
+ * Using multi-value dictionaries:
+ * 
+ *   - KH_MultiDict *KH_CreateMultiDict(KH_DictOptions *options)
+ *     
+ *     Creates a dictionary which maps each key to a list of values, or NULL
+ *     if it fails. options may be NULL, and are the same as for
+ *     KH_CreateDictWithOptions.
+ *   
+ *   - bool KH_MultiDictAdd(KH_MultiDict *multi, KH_Blob *key, KH_Blob *value)
+ *     
+ *     Appends a value to the list for key, adding the key if it isn't there
+ *     yet. Each key's values are kept in one array which doubles in size when
+ *     it fills up (starting from KH_MULTI_MIN_VALUES), so appending takes
+ *     amortised O(1) time and never copies the values already there. Returns
+ *     false if it fails to allocate memory.
+ *     
+ *     The values in multi->dict are empty view blobs with the arrays kept
+ *     behind them, so they never change. A clone of multi->dict, or one of
+ *     those blobs retained elsewhere, shares the arrays instead of copying
+ *     them, and sees values added later too.
+ *   
+ *   - KH_Blob **KH_MultiDictGet(KH_MultiDict *multi, KH_Blob *key, size_t *count)
+ *     
+ *     Returns the values for key in the order they were added and sets
+ *     *count to the number of them, or returns NULL and sets *count to zero
+ *     if the key isn't there. The array stays valid until the next change to
+ *     the dictionary.
+ *   
+ *   - bool KH_MultiDictDelete(KH_MultiDict *multi, KH_Blob *key)
+ *     
+ *     Removes a key and all of its values. Returns true if it was there.
+ *   
+ *   - KH_Blob *KH_MultiDictKeyIter(KH_MultiDict *multi, size_t index)
+ *   - KH_Blob **KH_MultiDictValuesIter(KH_MultiDict *multi, size_t index, size_t *count)
+ *     
+ *     Return the i-th key, or its values like KH_MultiDictGet, or NULL if it
+ *     would be out of bounds.
+ *   
+ *   - size_t KH_MultiDictLen(KH_MultiDict *multi)
+ *     
+ *     Returns the number of keys. The number of values under all of them is
+ *     in multi->value_count.
+ *   
+ *   - void KH_ReleaseMultiDict(KH_MultiDict *multi)
+ *     
+ *     Releases the dictionary and all of its keys and values.
+ * 
+ * Resize and rehash events:
+ * 
+ *   - void KH_DictSetEventHooks(KH_Dict *dict, KH_DictEventFunc before, KH_DictEventFunc after, void *context)
+ *     
+ *     Set functions to be called as before(context, dict, event) and
+ *     after(context, dict, event) around every time the dictionary resizes or
+ *     rebuilds its slots, which are the operations that can stall a single
+ *     call for a long time. Either function may be NULL, and passing NULL for
+ *     both turns the hooks off. Clones keep the hooks of the dictionary they
+ *     were cloned from. The hooks must not change the dictionary.
+ *     
+ *     The event has the following members:
+ *     
+ *     - kind, one of KH_DICT_EVENT_RESIZE (growing, shrinking or reserving),
+ *       KH_DICT_EVENT_REHASH (cleaning up deleted slots in place) or
+ *       KH_DICT_EVENT_RESEED (switching to a new seed after long probes)
+ *     - old_capacity, the number of entries the dictionary could hold before
+ *     - new_capacity, the number it can hold after; in the before hook, this
+ *       is the number it is trying to get to
+ *     - count, the number of entries
+ *     - tombstones, the number of deleted slots
+ *     - elapsed, the number of nanoseconds the event took, zero in the before
+ *       hook
+ *     - failed, true in the after hook if a resize failed to allocate memory,
+ *       in which case the dictionary is left as it was
+ *     
+ *     count and tombstones are as of when each hook is called.
+ * 
+ * Latency histograms:
+ * 
+ *   - If KHASHTABLE_STATS is defined before including the implementation, the
+ *     time taken by every KH_DictSet, KH_DictGet and KH_DictDelete call, and
+ *     by every time a dictionary grows, is recorded in a histogram for each of
+ *     them. These are shared by all dictionaries and safe to update from
+ *     several threads. Without KHASHTABLE_STATS nothing is recorded and
+ *     nothing is slowed down.
+ *     
+ *     Times are in nanoseconds. Buckets are exact below 8ns and then split each
+ *     power of two into 8, so a result is never more than 12.5% off, from a
+ *     few nanoseconds up to centuries. Resizes are also counted in the set
+ *     that triggered them, which is what shows up as tail latency.
+ *   
+ *   - bool KH_GetLatencyHistogram(int op, KH_Histogram *histogram)
+ *     
+ *     Copy the histogram for op, one of KH_STAT_SET, KH_STAT_GET,
+ *     KH_STAT_DELETE or KH_STAT_RESIZE. The histogram has the members:
+ *     
+ *     - counts, the number of operations in each of the KH_HISTOGRAM_BUCKETS
+ *       buckets
+ *     - total, the number of operations recorded
+ *     - sum, the total time they took, for working out the mean
+ *     - max, the longest one took
+ *     
+ *     Returns false and an empty histogram if KHASHTABLE_STATS wasn't defined.
+ *   
+ *   - void KH_ResetLatencyHistograms(void)
+ *     
+ *     Empty all the histograms, for example between benchmark phases.
+ *   
+ *   - uint64_t KH_HistogramPercentile(const KH_Histogram *histogram, double percentile)
+ *     
+ *     Return the time which percentile percent (0 to 100) of the operations in
+ *     the histogram took at most, such as 99.9 for the p999 latency.
+ * 
+ * Custom allocators:
+ *   
+ *   - All memory KHashTable allocates can be redirected to your own allocator
+ *     by filling in a KH_Allocator and passing it to KH_CreateBlobWith,
+ *     KH_CreateBlobViewWith or KH_CreateDictWithOptions:
+ *     
+ *     - alloc(context, size), which works like malloc
+ *     - realloc(context, ptr, size), which works like realloc
+ *     - free(context, ptr), which works like free
+ *     - context, which is passed to each of the above
+ *     
+ *   - Blobs and dictionaries remember the allocator they were created with and
+ *     give their memory back to it, so the KH_Allocator must outlive them.
+ *     Blobs from different allocators can be mixed freely in one dictionary.
+ * 
  * Zlib License
  * ------------
  * 
@@ -154,49 +619,279 @@
 #include <inttypes.h>
 #include <stdbool.h>
 
+// Slot values for unused slots, whatever the width of the slots is
+#define KH_HASH_EMPTY ((size_t)-1)
+#define KH_HASH_DELETED ((size_t)-2)
+
+enum {
+	KH_BLOB_HASHED = (1 << 0), // hash has been computed
+	KH_BLOB_VIEW = (1 << 1), // data is external, blob is really a KH_BlobView
+	KH_BLOB_PAIR_KEY = (1 << 2), // key heading a block that also holds its value
+	KH_BLOB_PAIR_VALUE = (1 << 3), // value living in the block of the key before it
+	KH_BLOB_PAIR_HALF_RELEASED = (1 << 4), // one half of a pair block was released
+	KH_BLOB_HASHING = (1 << 5), // some thread is storing the hash
+	KH_BLOB_HASH_CRC32C = (1 << 6), // hash is from KH_HashCrc32c rather than KH_Hash
+};
+
 enum {
-	KH_HASH_EMPTY = 0xffffffff,
-	KH_HASH_DELETED = 0xfffffffe,
+	KH_DICT_ALIGNED = (1 << 0), // slot and pair arrays are cache line aligned
+	KH_DICT_HUGE_PAGES = (1 << 1), // large slot and pair arrays use huge pages
+	KH_DICT_KEYED = (1 << 2), // keys are hashed with SipHash and a secret seed
+	KH_DICT_AUTO_SHRINK = (1 << 3), // shrink when deletes leave the dict mostly empty
+	KH_DICT_CRC32C = (1 << 4), // keys are hashed with the CRC32C based hash
 };
 
 #define KH_NOT_FOUND ((size_t)-1)
 
-typedef uint32_t kh_hash_t;
+// Dicts with up to this many entries have no slots and are searched by
+// scanning their pairs
+#ifndef KH_TINY_DICT_SIZE
+#define KH_TINY_DICT_SIZE 8
+#endif
+
+// Operations with latency histograms, when built with KHASHTABLE_STATS
+enum {
+	KH_STAT_SET, // KH_DictSet
+	KH_STAT_GET, // KH_DictGet
+	KH_STAT_DELETE, // KH_DictDelete
+	KH_STAT_RESIZE, // growing a dict, also counted in the operation causing it
+	KH_STAT_COUNT,
+};
+
+// Exact below 8ns, then 8 buckets per power of two, so within 12.5%
+#define KH_HISTOGRAM_BUCKETS 496
+
+typedef struct KH_Histogram {
+	uint64_t counts[KH_HISTOGRAM_BUCKETS];
+	uint64_t total; // Number of operations recorded
+	uint64_t sum; // Total nanoseconds taken by them
+	uint64_t max;
+} KH_Histogram;
+
+typedef struct KH_Allocator {
+	void *(*alloc)(void *context, size_t size);
+	void *(*realloc)(void *context, void *ptr, size_t size);
+	void (*free)(void *context, void *ptr);
+	void *context;
+} KH_Allocator;
+
+typedef uint64_t kh_hash_t;
 typedef struct KH_Blob {
+	const uint8_t *data;
 	size_t length;
 	kh_hash_t hash;
-	const uint8_t data[0];
+	uint32_t flags;
+	uint32_t refs; // Number of owners, the blob is freed when it drops to zero
+	const KH_Allocator *allocator; // NULL means malloc/realloc/free
 } KH_Blob;
 
-typedef uint32_t KH_Slot;
+typedef void (*KH_BlobReleaseFunc)(void *context, const uint8_t *data, size_t length);
+
+typedef struct KH_BlobView {
+	KH_Blob blob;
+	KH_BlobReleaseFunc release;
+	void *context;
+} KH_BlobView;
+
+typedef size_t KH_Slot;
 
 typedef struct KH_DictPair {
 	KH_Blob *key;
 	KH_Blob *value;
+	kh_hash_t hash; // Copy of the key's hash, so probing doesn't touch the key
 } KH_DictPair;
 
+// Kinds of KH_DictEvent
+enum {
+	KH_DICT_EVENT_RESIZE, // slots and pairs are reallocated at a new capacity
+	KH_DICT_EVENT_REHASH, // slots are rebuilt in place to clear deleted ones
+	KH_DICT_EVENT_RESEED, // keys are rehashed with a new seed after flooding
+};
+
+typedef struct KH_DictEvent {
+	int kind; // KH_DICT_EVENT_*
+	size_t old_capacity; // Entries the dict could hold before
+	size_t new_capacity; // Entries it can hold after (planned, in the before hook)
+	size_t count; // Entries in the dict
+	size_t tombstones; // Deleted slots in the dict
+	uint64_t elapsed; // Nanoseconds the event took, zero in the before hook
+	bool failed; // The resize couldn't allocate memory, only set in the after hook
+} KH_DictEvent;
+
+struct KH_Dict;
+typedef void (*KH_DictEventFunc)(void *context, struct KH_Dict *dict, const KH_DictEvent *event);
+
 typedef struct KH_Dict {
-	KH_Slot *slots;
+	void *slots; // Each slot is slot_size bytes, use KH_GetSlot/KH_SetSlot
 	KH_DictPair *pairs;
-	size_t data_count;
-	size_t data_alloced; // Must be a power of two
+	size_t data_count; // Number of entries
+	size_t data_alloced; // Number of slots, must be a power of two or zero
+	size_t pairs_alloced;
+	size_t pairs_used; // Pairs appended so far, including holes left by deletes
+	size_t pairs_head; // All pairs before this one are holes
+	uint64_t *expiry; // KH_Now() time each pair expires at or zero, NULL until one does
+	size_t sweep_next; // Pair KH_DictSweep carries on from
+	size_t tombstone_count; // Number of KH_HASH_DELETED slots
+	uint32_t threads; // Threads to rehash with, see KHASHTABLE_THREADS
+	const KH_Allocator *allocator;
+	uint32_t flags;
+	uint32_t slot_size;
+	uint64_t seed[2]; // SipHash key, used with KH_DICT_KEYED
+	size_t reseed_size; // Table size when the seed was last changed
+	KH_DictEventFunc before_event; // Hooks around resizes and rehashes
+	KH_DictEventFunc after_event;
+	void *event_context;
 } KH_Dict;
 
+typedef bool (*KH_DictConflictFunc)(void *context, KH_Blob *key, KH_Blob *old_value, KH_Blob *new_value);
+
+typedef struct KH_DictOptions {
+	const KH_Allocator *allocator; // NULL means malloc/realloc/free
+	uint32_t flags; // KH_DICT_*
+	uint64_t seed[2]; // SipHash key for KH_DICT_KEYED, random if all zero
+	uint32_t threads; // Threads to rehash big tables with, if built with KHASHTABLE_THREADS
+} KH_DictOptions;
+
+enum {
+	KH_CACHE_PROMOTE_ON_GET = (1 << 0), // KH_CacheGet makes the entry the most recently used
+	KH_CACHE_TINY_LFU = (1 << 1), // admit and evict by how often keys are used
+};
+
+// Number of the least recently used entries a KH_CACHE_TINY_LFU cache looks
+// at to find the least frequently used one to evict
+#ifndef KH_CACHE_SAMPLES
+#define KH_CACHE_SAMPLES 5
+#endif
+
+// 4-bit counters in the KH_CACHE_TINY_LFU frequency sketch per entry
+#ifndef KH_SKETCH_COUNTERS
+#define KH_SKETCH_COUNTERS 8
+#endif
+
+typedef struct KH_Cache {
+	KH_Dict *dict; // Entries from least to most recently used, don't change directly
+	size_t max_entries; // Zero means no limit
+	size_t max_bytes; // Limit on key and value lengths added up, zero means no limit
+	size_t bytes; // Key and value lengths of the entries added up
+	uint32_t flags; // KH_CACHE_*
+	uint64_t *sketch; // 4-bit use counters for KH_CACHE_TINY_LFU, 16 per word
+	size_t sketch_size; // Number of counters, a power of two
+	size_t sketch_additions; // Uses counted since the counters were last halved
+} KH_Cache;
+
+typedef struct KH_CacheOptions {
+	KH_DictOptions dict; // Options for the dict holding the entries
+	size_t max_entries;
+	size_t max_bytes;
+	uint32_t flags; // KH_CACHE_*
+} KH_CacheOptions;
+
+typedef struct KH_Set {
+	KH_Dict *dict; // Keys in the order they were added with NULL values, don't change directly
+} KH_Set;
+
+typedef struct KH_MultiDict {
+	KH_Dict *dict; // Each value is an empty view blob standing for the key's values, don't change directly
+	size_t value_count; // Values under all keys added up
+} KH_MultiDict;
+
+// Starting number of values a KH_MultiDict key has room for
+#ifndef KH_MULTI_MIN_VALUES
+#define KH_MULTI_MIN_VALUES 4
+#endif
+
 KH_Blob *KH_CreateBlob(const uint8_t *buffer, const size_t length);
+KH_Blob *KH_CreateBlobWith(const KH_Allocator *allocator, const uint8_t *buffer, const size_t length);
 KH_Blob *KH_BlobForString(const char *str);
+KH_Blob *KH_CreateBlobView(const uint8_t *buffer, const size_t length, KH_BlobReleaseFunc release, void *context);
+KH_Blob *KH_CreateBlobViewWith(const KH_Allocator *allocator, const uint8_t *buffer, const size_t length, KH_BlobReleaseFunc release, void *context);
+KH_Blob *KH_RetainBlob(KH_Blob *blob);
 void KH_ReleaseBlob(KH_Blob *blob);
 
 KH_Dict *KH_CreateDict(void);
+KH_Dict *KH_CreateDictWithOptions(const KH_DictOptions *options);
+KH_Dict *KH_DictClone(KH_Dict *self);
+bool KH_DictReserve(KH_Dict *self, size_t count);
+bool KH_DictUpdate(KH_Dict *self, KH_Dict *other, bool move, KH_DictConflictFunc resolve, void *context);
 void KH_ReleaseDict(KH_Dict *dict);
+void KH_DictClear(KH_Dict *self);
 bool KH_DictSet(KH_Dict *self, KH_Blob *key, KH_Blob *value);
+bool KH_DictSetBytes(KH_Dict *self, const uint8_t *key, size_t key_length, const uint8_t *value, size_t value_length);
+KH_Blob **KH_DictGetOrInsert(KH_Dict *self, KH_Blob *key, KH_Blob *value, bool *inserted);
+KH_Blob **KH_DictUpsert(KH_Dict *self, KH_Blob *key, KH_Blob *value, bool *inserted);
 KH_Blob *KH_DictGet(KH_Dict *self, KH_Blob *key);
 bool KH_DictHas(KH_Dict *self, KH_Blob *key);
 bool KH_DictDelete(KH_Dict *self, KH_Blob *key);
+bool KH_DictPopFirst(KH_Dict *self, KH_Blob **key, KH_Blob **value);
+bool KH_DictPopLast(KH_Dict *self, KH_Blob **key, KH_Blob **value);
 KH_Blob *KH_DictKeyIter(KH_Dict *self, size_t index);
 KH_Blob *KH_DictValueIter(KH_Dict *self, size_t index);
 size_t KH_DictLen(KH_Dict *self);
+bool KH_DictShrinkToFit(KH_Dict *self);
+void KH_DictSetEventHooks(KH_Dict *self, KH_DictEventFunc before, KH_DictEventFunc after, void *context);
+uint64_t KH_Now(void);
+bool KH_DictSetExpiring(KH_Dict *self, KH_Blob *key, KH_Blob *value, uint64_t expires);
+bool KH_DictExpire(KH_Dict *self, KH_Blob *key, uint64_t expires);
+size_t KH_DictSweep(KH_Dict *self, size_t budget);
+
+KH_Cache *KH_CreateCache(const KH_CacheOptions *options);
+void KH_ReleaseCache(KH_Cache *self);
+bool KH_CacheSet(KH_Cache *self, KH_Blob *key, KH_Blob *value);
+KH_Blob *KH_CacheGet(KH_Cache *self, KH_Blob *key);
+bool KH_CacheDelete(KH_Cache *self, KH_Blob *key);
+size_t KH_CacheLen(KH_Cache *self);
+
+KH_Set *KH_CreateSet(const KH_DictOptions *options);
+KH_Set *KH_SetClone(KH_Set *self);
+void KH_ReleaseSet(KH_Set *self);
+bool KH_SetAdd(KH_Set *self, KH_Blob *key, bool *added);
+bool KH_SetHas(KH_Set *self, KH_Blob *key);
+bool KH_SetDelete(KH_Set *self, KH_Blob *key);
+KH_Blob *KH_SetIter(KH_Set *self, size_t index);
+size_t KH_SetLen(KH_Set *self);
+bool KH_SetUnion(KH_Set *self, KH_Set *other);
+void KH_SetIntersection(KH_Set *self, KH_Set *other);
+void KH_SetDifference(KH_Set *self, KH_Set *other);
+
+KH_MultiDict *KH_CreateMultiDict(const KH_DictOptions *options);
+void KH_ReleaseMultiDict(KH_MultiDict *self);
+bool KH_MultiDictAdd(KH_MultiDict *self, KH_Blob *key, KH_Blob *value);
+KH_Blob **KH_MultiDictGet(KH_MultiDict *self, KH_Blob *key, size_t *count);
+bool KH_MultiDictDelete(KH_MultiDict *self, KH_Blob *key);
+KH_Blob *KH_MultiDictKeyIter(KH_MultiDict *self, size_t index);
+KH_Blob **KH_MultiDictValuesIter(KH_MultiDict *self, size_t index, size_t *count);
+size_t KH_MultiDictLen(KH_MultiDict *self);
+
+bool KH_GetLatencyHistogram(int op, KH_Histogram *histogram);
+void KH_ResetLatencyHistograms(void);
+uint64_t KH_HistogramPercentile(const KH_Histogram *histogram, double percentile);
 
 #ifdef KHASHTABLE_IMPLEMENTATION
+#include <time.h>
+#ifdef KHASHTABLE_THREADS
+#include <pthread.h>
+#endif
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/random.h>
+#endif
+// Strict ISO C modes hide MAP_ANONYMOUS, in which case tables aren't mapped
+#if defined(MAP_ANONYMOUS)
+#define KH_MAP_ANONYMOUS MAP_ANONYMOUS
+#elif defined(MAP_ANON)
+#define KH_MAP_ANONYMOUS MAP_ANON
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define KH_CRC32C_SSE42
+#elif defined(__ARM_FEATURE_CRC32) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_acle.h>
+#define KH_CRC32C_ARM
+#endif
+
+#define KH_TABLE_ALIGN 64
+#define KH_HUGE_PAGE_SIZE ((size_t) 2 << 20)
+
 static kh_hash_t KH_Hash(const uint8_t *buffer, const size_t length) {
 	kh_hash_t hash = 5381;
 	
@@ -207,328 +902,3228 @@ static kh_hash_t KH_Hash(const uint8_t *buffer, const size_t length) {
 	return hash;
 }
 
-KH_Blob *KH_CreateBlob(const uint8_t *buffer, const size_t length) {
-	KH_Blob *blob = malloc(sizeof *blob + length);
-	
-	if (!blob) {
-		return NULL;
+static const uint32_t KH_Crc32cTable[256] = {
+	0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c, 0x26a1e7e8, 0xd4ca64eb,
+	0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b, 0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24,
+	0x105ec76f, 0xe235446c, 0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+	0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc, 0xbc267848, 0x4e4dfb4b,
+	0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a, 0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35,
+	0xaa64d611, 0x580f5512, 0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+	0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad, 0x1642ae59, 0xe4292d5a,
+	0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a, 0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595,
+	0x417b1dbc, 0xb3109ebf, 0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+	0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f, 0xed03a29b, 0x1f682198,
+	0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927, 0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38,
+	0xdbfc821c, 0x2997011f, 0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+	0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e, 0x4767748a, 0xb50cf789,
+	0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859, 0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46,
+	0x7198540d, 0x83f3d70e, 0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+	0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de, 0xdde0eb2a, 0x2f8b6829,
+	0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c, 0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93,
+	0x082f63b7, 0xfa44e0b4, 0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+	0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b, 0xb4091bff, 0x466298fc,
+	0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c, 0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033,
+	0xa24bb5a6, 0x502036a5, 0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+	0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975, 0x0e330a81, 0xfc588982,
+	0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d, 0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622,
+	0x38cc2a06, 0xcaa7a905, 0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+	0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8, 0xe52cc12c, 0x1747422f,
+	0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff, 0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0,
+	0xd3d3e1ab, 0x21b862a8, 0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+	0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78, 0x7fab5e8c, 0x8dc0dd8f,
+	0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee, 0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1,
+	0x69e9f0d5, 0x9b8273d6, 0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+	0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69, 0xd5cf889d, 0x27a40b9e,
+	0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e, 0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351,
+};
+
+static uint32_t KH_Crc32cBytes(uint32_t crc, const uint8_t *buffer, size_t length) {
+	// CRC32C without the usual inversions, as the crc32 instruction does it
+	for (size_t i = 0; i < length; i++) {
+		crc = KH_Crc32cTable[(crc ^ buffer[i]) & 0xff] ^ (crc >> 8);
 	}
 	
-	blob->length = length;
-	blob->hash = KH_Hash(buffer, length);
-	memcpy((void *) blob->data, buffer, length);
+	return crc;
+}
+
+static kh_hash_t KH_Crc32cFinish(uint32_t a, uint32_t b, uint32_t c, size_t length) {
+	/**
+	 * CRCs are linear and each lane only has 32 bits, so the lanes are mixed
+	 * with the length by the MurmurHash3 finaliser, spreading every input bit
+	 * over the low bits which pick the slot.
+	 */
 	
-	return blob;
+	uint64_t h = (((uint64_t) a << 32) | b) ^ ((uint64_t) c * 0x9e3779b97f4a7c15ull) ^ (uint64_t) length;
+	
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	
+	return h;
 }
 
-KH_Blob *KH_BlobForString(const char *str) {
-	return KH_CreateBlob((const uint8_t *) str, strlen(str) + 1);
+// The CRC32C hash runs three independent CRCs over interleaved 8 byte words,
+// so the crc32 instruction's latency is hidden. Any remaining words go to the
+// first lane and the last few bytes to the second. Every kernel expands this
+// with its own way of adding a word and a byte, so they all give the same
+// hash for the same key.
+#define KH_CRC32C_KERNEL(WORD, BYTE) do { \
+		uint32_t a = 0xffffffffu, b = 0x9e3779b9u, c = 0x7f4a7c15u; \
+		const uint8_t *p = buffer, *end = buffer + length; \
+		for (; end - p >= 24; p += 24) { \
+			a = WORD(a, p); \
+			b = WORD(b, p + 8); \
+			c = WORD(c, p + 16); \
+		} \
+		for (; end - p >= 8; p += 8) { \
+			a = WORD(a, p); \
+		} \
+		for (; p != end; p++) { \
+			b = BYTE(b, *p); \
+		} \
+		return KH_Crc32cFinish(a, b, c, length); \
+	} while (0)
+
+#define KH_CRC32C_WORD_SCALAR(crc, p) KH_Crc32cBytes((crc), (p), 8)
+#define KH_CRC32C_BYTE_SCALAR(crc, byte) (KH_Crc32cTable[((crc) ^ (byte)) & 0xff] ^ ((crc) >> 8))
+
+static kh_hash_t KH_HashCrc32cScalar(const uint8_t *buffer, const size_t length) {
+	KH_CRC32C_KERNEL(KH_CRC32C_WORD_SCALAR, KH_CRC32C_BYTE_SCALAR);
 }
 
-static bool KH_BlobEqual(KH_Blob *blob1, KH_Blob *blob2) {
-	if (blob1 == blob2) {
-		return true;
-	}
-	
-	if (blob1->hash != blob2->hash || blob1->length != blob2->length) {
-		return false;
-	}
-	
-	return memcmp(blob1->data, blob2->data, blob1->length) == 0;
+static uint64_t KH_LoadWord(const uint8_t *p) {
+	// Unaligned loads, which compilers turn into a single instruction
+	uint64_t word;
+	memcpy(&word, p, sizeof word);
+	return word;
 }
 
-void KH_ReleaseBlob(KH_Blob *blob) {
-	free(blob);
+static uint32_t KH_LoadHalfWord(const uint8_t *p) {
+	uint32_t word;
+	memcpy(&word, p, sizeof word);
+	return word;
 }
 
-static uint32_t KH_BlobStartingIndexForSize(uint32_t hash, size_t size) {
-	// WARNING: Only works for powers of two
-	return hash & (size - 1);
+#ifdef KH_CRC32C_SSE42
+#define KH_CRC32C_WORD_SSE42(crc, p) ((uint32_t) _mm_crc32_u64((crc), KH_LoadWord(p)))
+#define KH_CRC32C_BYTE_SSE42(crc, byte) _mm_crc32_u8((crc), (byte))
+
+__attribute__((target("sse4.2")))
+static kh_hash_t KH_HashCrc32cSse42(const uint8_t *buffer, const size_t length) {
+	KH_CRC32C_KERNEL(KH_CRC32C_WORD_SSE42, KH_CRC32C_BYTE_SSE42);
+}
+#endif
+
+#ifdef KH_CRC32C_ARM
+#define KH_CRC32C_WORD_ARM(crc, p) __crc32cd((crc), KH_LoadWord(p))
+#define KH_CRC32C_BYTE_ARM(crc, byte) __crc32cb((crc), (byte))
+
+static kh_hash_t KH_HashCrc32cArm(const uint8_t *buffer, const size_t length) {
+	KH_CRC32C_KERNEL(KH_CRC32C_WORD_ARM, KH_CRC32C_BYTE_ARM);
 }
+#endif
 
-static void KH_InsertSlot(KH_Slot *slots, size_t nslots, uint32_t hash, uint32_t index) {
-	uint32_t slot_index = KH_BlobStartingIndexForSize(hash, nslots);
+typedef kh_hash_t (*KH_HashFunc)(const uint8_t *buffer, const size_t length);
+
+static KH_HashFunc KH_PickCrc32cKernel(void) {
+	/**
+	 * Pick the fastest CRC32C kernel this CPU can run. ARM builds targeting
+	 * CPUs with CRC32 always have it, x86-64 has to ask.
+	 */
 	
-	while (1) {
-		if (slots[slot_index] == KH_HASH_EMPTY || slots[slot_index] == KH_HASH_DELETED) {
-			slots[slot_index] = index;
-			break;
-		}
-		
-		slot_index = (slot_index + 1) & (nslots - 1);
+#if defined(KH_CRC32C_SSE42)
+	if (__builtin_cpu_supports("sse4.2")) {
+		return KH_HashCrc32cSse42;
 	}
+#elif defined(KH_CRC32C_ARM)
+	return KH_HashCrc32cArm;
+#endif
+	
+	return KH_HashCrc32cScalar;
 }
 
-static KH_Dict *KH_ResizeDict(KH_Dict *self) {
+static kh_hash_t KH_HashCrc32c(const uint8_t *buffer, const size_t length) {
 	/**
-	 * Resize a dict, or if it has size zero, allocate the initial memory.
+	 * Hash a buffer with the CRC32C kernel picked on first use. Every kernel
+	 * gives the same result, so racing to pick one is harmless.
 	 */
 	
-	// New size of the prealloced memory and index data
-	size_t new_size = (self->data_alloced) ? (2 * self->data_alloced) : (8);
+	static KH_HashFunc kernel;
 	
-	// Alloc new slots and pair data
-	KH_Slot *new_slots = malloc(sizeof *self->slots * new_size);
-	KH_DictPair *new_pairs = malloc(sizeof *self->pairs * new_size);
+#ifdef __GNUC__
+	KH_HashFunc picked = __atomic_load_n(&kernel, __ATOMIC_RELAXED);
 	
-	if (!new_slots || !new_pairs) {
-		free(new_slots);
-		free(new_pairs);
-		return NULL;
+	if (!picked) {
+		picked = KH_PickCrc32cKernel();
+		__atomic_store_n(&kernel, picked, __ATOMIC_RELAXED);
 	}
-	
-	// Init slots to empty (0xFFFFFFFF)
-	for (size_t i = 0; i < new_size; i++) {
-		new_slots[i] = KH_HASH_EMPTY;
+#else
+	if (!kernel) {
+		kernel = KH_PickCrc32cKernel();
 	}
 	
-	// Init pairs to empty (NULL)
-	memset(new_pairs, 0, sizeof *self->pairs * new_size);
+	KH_HashFunc picked = kernel;
+#endif
 	
-	// Copy old pairs to new pairs
-	size_t j = 0;
+	return picked(buffer, length);
+}
+
+#define KH_ROTL64(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define KH_SIPROUND() do { \
+		v0 += v1; v1 = KH_ROTL64(v1, 13); v1 ^= v0; v0 = KH_ROTL64(v0, 32); \
+		v2 += v3; v3 = KH_ROTL64(v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = KH_ROTL64(v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = KH_ROTL64(v1, 17); v1 ^= v2; v2 = KH_ROTL64(v2, 32); \
+	} while (0)
+
+static kh_hash_t KH_SipHash(const uint64_t seed[2], const uint8_t *buffer, const size_t length) {
+	/**
+	 * SipHash-2-4. Unlike DJB2, collisions can't be found without knowing the
+	 * seed, so it's used for dicts that may see hostile keys.
+	 */
 	
-	for (size_t i = 0; i < self->data_alloced; i++) {
-		// This used to continue, but since it can never be sparse due the the
-		// current way we delete things just breaking is faster.
-		if (!self->pairs[i].key || !self->pairs[i].value) {
-			break;
+	uint64_t v0 = seed[0] ^ 0x736f6d6570736575ull;
+	uint64_t v1 = seed[1] ^ 0x646f72616e646f6dull;
+	uint64_t v2 = seed[0] ^ 0x6c7967656e657261ull;
+	uint64_t v3 = seed[1] ^ 0x7465646279746573ull;
+	size_t tail = length & 7;
+	const uint8_t *end = buffer + length - tail;
+	
+	for (const uint8_t *p = buffer; p != end; p += 8) {
+		uint64_t m = 0;
+		
+		for (int i = 0; i < 8; i++) {
+			m |= (uint64_t) p[i] << (8 * i);
 		}
 		
-		new_pairs[j].key = self->pairs[i].key;
-		new_pairs[j].value = self->pairs[i].value;
-		KH_InsertSlot(new_slots, new_size, new_pairs[j].key->hash, j);
-		j++;
+		v3 ^= m;
+		KH_SIPROUND();
+		KH_SIPROUND();
+		v0 ^= m;
 	}
 	
-	// j is now the new data_count
+	uint64_t b = (uint64_t) length << 56;
 	
-	// We should be ready to free old stuff, place new stuff
-	free(self->slots);
-	free(self->pairs);
-	self->slots = new_slots;
-	self->pairs = new_pairs;
-	self->data_alloced = new_size;
-	self->data_count = j;
+	for (size_t i = 0; i < tail; i++) {
+		b |= (uint64_t) end[i] << (8 * i);
+	}
 	
-	return self;
+	v3 ^= b;
+	KH_SIPROUND();
+	KH_SIPROUND();
+	v0 ^= b;
+	
+	v2 ^= 0xff;
+	KH_SIPROUND();
+	KH_SIPROUND();
+	KH_SIPROUND();
+	KH_SIPROUND();
+	
+	return v0 ^ v1 ^ v2 ^ v3;
 }
 
-static bool KH_DictInsert(KH_Dict *self, KH_Blob *key, KH_Blob *value) {
+#undef KH_SIPROUND
+#undef KH_ROTL64
+
+static void KH_RandomSeed(KH_Dict *self) {
 	/**
-	 * Insert an entry into the hash table. The key must not exist.
+	 * Pick a new random SipHash seed for the dict. The OS is asked first; if
+	 * that doesn't work, the time, the old seed and some addresses are mixed
+	 * together, which is still unpredictable enough to stop casual flooding.
 	 */
 	
-	// Resize if load factor > 0.625, around Wikipedia's recommendation of
-	// resizing at 0.6-0.75
-	if (self->data_count >= ((self->data_alloced >> 1) + (self->data_alloced >> 3))) {
-		self = KH_ResizeDict(self);
-		
-		if (!self) {
-			return false;
-		}
+#ifdef __linux__
+	if (getrandom(self->seed, sizeof self->seed, GRND_NONBLOCK) == (ssize_t) sizeof self->seed) {
+		return;
 	}
+#endif
 	
-	self->pairs[self->data_count].key = key;
-	self->pairs[self->data_count].value = value;
-	
-	KH_InsertSlot(self->slots, self->data_alloced, key->hash, self->data_count);
-	
-	self->data_count++;
+	uint64_t x = (uint64_t) time(NULL) ^ ((uint64_t) clock() << 32) ^ (uint64_t) (uintptr_t) self ^ (uint64_t) (uintptr_t) &x;
 	
-	return true;
+	for (int i = 0; i < 2; i++) {
+		// SplitMix64
+		x ^= self->seed[i];
+		x += 0x9e3779b97f4a7c15ull;
+		uint64_t z = x;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		self->seed[i] = z ^ (z >> 31);
+	}
 }
 
-static void KH_DictChange(KH_Dict *self, size_t index, KH_Blob *value) {
+static void *KH_Alloc(const KH_Allocator *allocator, size_t size) {
+	return allocator ? allocator->alloc(allocator->context, size) : malloc(size);
+}
+
+static void *KH_Realloc(const KH_Allocator *allocator, void *ptr, size_t size) {
+	return allocator ? allocator->realloc(allocator->context, ptr, size) : realloc(ptr, size);
+}
+
+static void KH_Free(const KH_Allocator *allocator, void *ptr) {
+	if (allocator) {
+		allocator->free(allocator->context, ptr);
+	}
+	else {
+		free(ptr);
+	}
+}
+
+typedef struct KH_TableHeader {
+	void *base; // start of the allocation or mapping
+	size_t size; // usable size of the table
+	size_t mapped; // length of the mapping, or zero if it came from the allocator
+} KH_TableHeader;
+
+static void *KH_AllocTable(KH_Dict *self, size_t size) {
 	/**
-	 * Change the value for a key that already exists, given the index to the
-	 * key.
+	 * Allocate a slot or pair array for the dict. With KH_DICT_ALIGNED or
+	 * KH_DICT_HUGE_PAGES the array is cache line aligned and has a header
+	 * in front of it recording how to free it.
 	 */
 	
-	free(self->pairs[index].value);
-	self->pairs[index].value = value;
-}
+	if (!(self->flags & (KH_DICT_ALIGNED | KH_DICT_HUGE_PAGES))) {
+		return KH_Alloc(self->allocator, size);
+	}
+	
+	KH_TableHeader *header;
+	uint8_t *table;
+	
+#if defined(__linux__) && defined(KH_MAP_ANONYMOUS)
+	// Try explicit huge pages first, then transparent ones, then fall back to
+	// the allocator if we can't map anything at all.
+	if ((self->flags & KH_DICT_HUGE_PAGES) && size >= KH_HUGE_PAGE_SIZE) {
+		size_t mapped = (size + KH_TABLE_ALIGN + KH_HUGE_PAGE_SIZE - 1) & ~(KH_HUGE_PAGE_SIZE - 1);
+		void *base = MAP_FAILED;
+		
+#ifdef MAP_HUGETLB
+		base = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | KH_MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+		
+		if (base == MAP_FAILED) {
+			base = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | KH_MAP_ANONYMOUS, -1, 0);
+			
+#ifdef MADV_HUGEPAGE
+			if (base != MAP_FAILED) {
+				madvise(base, mapped, MADV_HUGEPAGE);
+			}
+#endif
+		}
+		
+		if (base != MAP_FAILED) {
+			table = (uint8_t *) base + KH_TABLE_ALIGN;
+			header = (KH_TableHeader *) table - 1;
+			header->base = base;
+			header->size = size;
+			header->mapped = mapped;
+			return table;
+		}
+	}
+#endif
+	
+	uint8_t *base = KH_Alloc(self->allocator, sizeof *header + size + KH_TABLE_ALIGN - 1);
+	
+	if (!base) {
+		return NULL;
+	}
+	
+	table = (uint8_t *) (((uintptr_t) (base + sizeof *header) + KH_TABLE_ALIGN - 1) & ~(uintptr_t) (KH_TABLE_ALIGN - 1));
+	header = (KH_TableHeader *) table - 1;
+	header->base = base;
+	header->size = size;
+	header->mapped = 0;
+	
+	return table;
+}
+
+static void KH_FreeTable(KH_Dict *self, void *table) {
+	if (!(self->flags & (KH_DICT_ALIGNED | KH_DICT_HUGE_PAGES))) {
+		KH_Free(self->allocator, table);
+		return;
+	}
+	
+	if (!table) {
+		return;
+	}
+	
+	KH_TableHeader *header = (KH_TableHeader *) table - 1;
+	
+#ifdef __linux__
+	if (header->mapped) {
+		munmap(header->base, header->mapped);
+		return;
+	}
+#endif
+	
+	KH_Free(self->allocator, header->base);
+}
+
+static void *KH_ReallocTable(KH_Dict *self, void *table, size_t size) {
+	if (!(self->flags & (KH_DICT_ALIGNED | KH_DICT_HUGE_PAGES))) {
+		return KH_Realloc(self->allocator, table, size);
+	}
+	
+	void *new_table = KH_AllocTable(self, size);
+	
+	if (!new_table) {
+		return NULL;
+	}
+	
+	if (table) {
+		size_t old_size = ((KH_TableHeader *) table - 1)->size;
+		memcpy(new_table, table, (old_size < size) ? old_size : size);
+		KH_FreeTable(self, table);
+	}
+	
+	return new_table;
+}
+
+static uint32_t KH_AtomicAdd(uint32_t *value, uint32_t amount) {
+	// Blobs can be shared between dicts used on different threads, so their
+	// reference counts and flags are updated atomically where we can.
+#ifdef __GNUC__
+	return __atomic_add_fetch(value, amount, __ATOMIC_ACQ_REL);
+#else
+	return *value += amount;
+#endif
+}
+
+static uint32_t KH_AtomicLoad(uint32_t *value) {
+	// Acquire, so whatever was stored before the value was published is seen
+#ifdef __GNUC__
+	return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+#else
+	return *value;
+#endif
+}
+
+static uint32_t KH_AtomicOr(uint32_t *value, uint32_t bits) {
+	// Returns the old value
+#ifdef __GNUC__
+	return __atomic_fetch_or(value, bits, __ATOMIC_ACQ_REL);
+#else
+	uint32_t old = *value;
+	*value |= bits;
+	return old;
+#endif
+}
+
+static uint64_t KH_HistogramBucketStart(size_t bucket) {
+	// The smallest number of nanoseconds that lands in this bucket
+	if (bucket < 8) {
+		return bucket;
+	}
+	
+	return (uint64_t) (8 + bucket % 8) << (bucket / 8 - 1);
+}
+
+static uint64_t KH_Nanoseconds(void) {
+	// Monotonic where we can, since wall clock jumps would be recorded as
+	// absurd latencies. Strict ISO C modes hide CLOCK_MONOTONIC, and before
+	// C23 have no monotonic clock at all, so then only UTC is left. C99 has
+	// no timespec_get either, so it gets whole seconds from time().
+#if defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+	struct timespec ts;
+#if defined(TIME_MONOTONIC)
+	timespec_get(&ts, TIME_MONOTONIC);
+#else
+	timespec_get(&ts, TIME_UTC);
+#endif
+	return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+#else
+	return (uint64_t) time(NULL) * 1000000000u;
+#endif
+}
+
+#ifdef KHASHTABLE_STATS
+static KH_Histogram KH_LatencyHistograms[KH_STAT_COUNT];
+
+static size_t KH_Log2(uint64_t value) {
+	// value must not be zero
+#ifdef __GNUC__
+	return 63 - __builtin_clzll(value);
+#else
+	size_t log = 0;
+	
+	while (value >>= 1) {
+		log++;
+	}
+	
+	return log;
+#endif
+}
+
+static size_t KH_HistogramBucket(uint64_t value) {
+	if (value < 8) {
+		return value;
+	}
+	
+	size_t log = KH_Log2(value);
+	
+	return (log - 2) * 8 + ((value >> (log - 3)) & 7);
+}
+
+static void KH_RecordLatency(int op, uint64_t start) {
+	/**
+	 * Add the time since start to an operation's histogram. The histograms
+	 * are shared by all dicts, so they're updated with relaxed atomics: each
+	 * counter is exact, but a reader may see one that's a little ahead of
+	 * the others.
+	 */
+	
+	uint64_t elapsed = KH_Nanoseconds() - start;
+	KH_Histogram *histogram = &KH_LatencyHistograms[op];
+	uint64_t *counter = &histogram->counts[KH_HistogramBucket(elapsed)];
+	
+#ifdef __GNUC__
+	__atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->total, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->sum, elapsed, __ATOMIC_RELAXED);
+	
+	uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+	
+	while (elapsed > max && !__atomic_compare_exchange_n(&histogram->max, &max, elapsed, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		// max now holds the latest value, try again
+	}
+#else
+	(*counter)++;
+	histogram->total++;
+	histogram->sum += elapsed;
+	
+	if (elapsed > histogram->max) {
+		histogram->max = elapsed;
+	}
+#endif
+}
+
+#define KH_STAT_BEGIN() uint64_t kh_stat_start = KH_Nanoseconds()
+#define KH_STAT_END(op) KH_RecordLatency(op, kh_stat_start)
+#else
+#define KH_STAT_BEGIN() ((void) 0)
+#define KH_STAT_END(op) ((void) 0)
+#endif
+
+KH_Blob *KH_CreateBlob(const uint8_t *buffer, const size_t length) {
+	return KH_CreateBlobWith(NULL, buffer, length);
+}
+
+KH_Blob *KH_CreateBlobWith(const KH_Allocator *allocator, const uint8_t *buffer, const size_t length) {
+	KH_Blob *blob = KH_Alloc(allocator, sizeof *blob + length);
+	
+	if (!blob) {
+		return NULL;
+	}
+	
+	// The hash is only computed once the blob is used as a key, so values
+	// never pay for it.
+	blob->data = (const uint8_t *) (blob + 1);
+	blob->length = length;
+	blob->hash = 0;
+	blob->flags = 0;
+	blob->refs = 1;
+	blob->allocator = allocator;
+	memcpy((void *) blob->data, buffer, length);
+	
+	return blob;
+}
+
+KH_Blob *KH_CreateBlobView(const uint8_t *buffer, const size_t length, KH_BlobReleaseFunc release, void *context) {
+	return KH_CreateBlobViewWith(NULL, buffer, length, release, context);
+}
+
+KH_Blob *KH_CreateBlobViewWith(const KH_Allocator *allocator, const uint8_t *buffer, const size_t length, KH_BlobReleaseFunc release, void *context) {
+	/**
+	 * Create a blob which refers to the given buffer instead of copying it.
+	 * When the blob is released, release(context, buffer, length) is called if
+	 * release isn't NULL.
+	 */
+	
+	KH_BlobView *view = KH_Alloc(allocator, sizeof *view);
+	
+	if (!view) {
+		return NULL;
+	}
+	
+	view->blob.data = buffer;
+	view->blob.length = length;
+	view->blob.hash = 0;
+	view->blob.flags = KH_BLOB_VIEW;
+	view->blob.refs = 1;
+	view->blob.allocator = allocator;
+	view->release = release;
+	view->context = context;
+	
+	return &view->blob;
+}
+
+KH_Blob *KH_BlobForString(const char *str) {
+	return KH_CreateBlob((const uint8_t *) str, strlen(str) + 1);
+}
+
+static kh_hash_t KH_BlobHash(KH_Blob *blob, bool crc32c) {
+	/**
+	 * Return the hash of a blob with KH_Hash or KH_HashCrc32c, computing and
+	 * caching it on first use. Only the first kind of hash asked for is
+	 * cached, which is the only kind nearly every blob ever needs.
+	 */
+	
+	uint32_t kind = crc32c ? KH_BLOB_HASH_CRC32C : 0;
+	
+	// Another thread may be storing the hash, which it only marks as hashed
+	// after, so both bits are tested on one load that orders the hash read
+	uint32_t flags = KH_AtomicLoad(&blob->flags);
+	
+	if ((flags & KH_BLOB_HASHED) && (flags & KH_BLOB_HASH_CRC32C) == kind) {
+		return blob->hash;
+	}
+	
+	kh_hash_t hash = crc32c ? KH_HashCrc32c(blob->data, blob->length) : KH_Hash(blob->data, blob->length);
+	
+	// Only the first thread to get here stores its hash, so the hash and its
+	// kind can't come from two different threads
+	if (!(KH_AtomicOr(&blob->flags, KH_BLOB_HASHING) & KH_BLOB_HASHING)) {
+		blob->hash = hash;
+		KH_AtomicOr(&blob->flags, KH_BLOB_HASHED | kind);
+	}
+	
+	return hash;
+}
+
+static bool KH_BytesEqual(const uint8_t *a, const uint8_t *b, size_t length) {
+	/**
+	 * Equality only, which unlike memcmp doesn't need to find the first
+	 * difference. Short lengths are covered by two loads from each end,
+	 * which overlap when the length isn't a multiple of the load size.
+	 */
+	
+	if (a == b) {
+		return true;
+	}
+	
+	if (length <= 16) {
+		if (length >= 8) {
+			return ((KH_LoadWord(a) ^ KH_LoadWord(b)) | (KH_LoadWord(a + length - 8) ^ KH_LoadWord(b + length - 8))) == 0;
+		}
+		
+		if (length >= 4) {
+			return ((KH_LoadHalfWord(a) ^ KH_LoadHalfWord(b)) | (KH_LoadHalfWord(a + length - 4) ^ KH_LoadHalfWord(b + length - 4))) == 0;
+		}
+		
+		// The first, middle and last bytes are every byte up to three
+		return !length || (a[0] == b[0] && a[length / 2] == b[length / 2] && a[length - 1] == b[length - 1]);
+	}
+	
+	// Past that, libc's memcmp is already vectorised and picks the widest
+	// instructions the CPU has
+	return memcmp(a, b, length) == 0;
+}
+
+static bool KH_BlobEqual(KH_Blob *blob1, KH_Blob *blob2) {
+	// Callers compare the hashes stored in the pairs before getting here, so
+	// only the contents are left to check.
+	if (blob1 == blob2) {
+		return true;
+	}
+	
+	if (blob1->length != blob2->length) {
+		return false;
+	}
+	
+	return KH_BytesEqual(blob1->data, blob2->data, blob1->length);
+}
+
+static KH_Blob *KH_CreateBlobPair(const KH_Allocator *allocator, const uint8_t *key, size_t key_length, const uint8_t *value, size_t value_length) {
+	/**
+	 * Create a key and value blob using a single allocation. The block is laid
+	 * out as [key header][value header][key data][value data], so the value's
+	 * header is always right after the key's. Returns the key.
+	 */
+	
+	KH_Blob *pair = KH_Alloc(allocator, 2 * sizeof *pair + key_length + value_length);
+	
+	if (!pair) {
+		return NULL;
+	}
+	
+	pair[0].data = (const uint8_t *) (pair + 2);
+	pair[0].length = key_length;
+	pair[0].hash = 0;
+	pair[0].flags = KH_BLOB_PAIR_KEY;
+	pair[0].refs = 1;
+	pair[0].allocator = allocator;
+	memcpy((void *) pair[0].data, key, key_length);
+	
+	pair[1].data = pair[0].data + key_length;
+	pair[1].length = value_length;
+	pair[1].hash = 0;
+	pair[1].flags = KH_BLOB_PAIR_VALUE;
+	pair[1].refs = 1;
+	pair[1].allocator = allocator;
+	memcpy((void *) pair[1].data, value, value_length);
+	
+	return &pair[0];
+}
+
+KH_Blob *KH_RetainBlob(KH_Blob *blob) {
+	if (blob) {
+		KH_AtomicAdd(&blob->refs, 1);
+	}
+	
+	return blob;
+}
+
+void KH_ReleaseBlob(KH_Blob *blob) {
+	if (!blob) {
+		return;
+	}
+	
+	if (KH_AtomicAdd(&blob->refs, -1) != 0) {
+		return;
+	}
+	
+	// Either half of a pair block can be released first, the block is freed
+	// along with the second one.
+	if (blob->flags & (KH_BLOB_PAIR_KEY | KH_BLOB_PAIR_VALUE)) {
+		KH_Blob *owner = (blob->flags & KH_BLOB_PAIR_VALUE) ? (blob - 1) : blob;
+		
+		if (KH_AtomicOr(&owner->flags, KH_BLOB_PAIR_HALF_RELEASED) & KH_BLOB_PAIR_HALF_RELEASED) {
+			KH_Free(owner->allocator, owner);
+		}
+		
+		return;
+	}
+	
+	if (blob->flags & KH_BLOB_VIEW) {
+		KH_BlobView *view = (KH_BlobView *) blob;
+		
+		if (view->release) {
+			view->release(view->context, blob->data, blob->length);
+		}
+	}
+	
+	KH_Free(blob->allocator, blob);
+}
+
+static size_t KH_BlobStartingIndexForSize(kh_hash_t hash, size_t size) {
+	// WARNING: Only works for powers of two
+	return (size_t) hash & (size - 1);
+}
+
+static size_t KH_UsableForSize(size_t size) {
+	// Number of pairs a table with this many slots holds before resizing, for
+	// a load factor of 0.625, around Wikipedia's recommendation of resizing
+	// at 0.6-0.75. The pair array is only allocated this large.
+	return (size >> 1) + (size >> 3);
+}
+
+static uint32_t KH_SlotSizeForSize(size_t size) {
+	/**
+	 * Pick the smallest slot width which can index every pair a table with
+	 * this many slots can hold, leaving the top two values for
+	 * KH_HASH_EMPTY and KH_HASH_DELETED.
+	 */
+	
+	uint64_t usable = KH_UsableForSize(size);
+	
+	if (usable <= UINT8_MAX - 1) {
+		return 1;
+	}
+	else if (usable <= UINT16_MAX - 1) {
+		return 2;
+	}
+	else if (usable <= UINT32_MAX - 1) {
+		return 4;
+	}
+	else {
+		return 8;
+	}
+}
+
+static KH_Slot KH_GetSlot(const void *slots, uint32_t slot_size, size_t i) {
+	/**
+	 * Read a slot from an array of slot_size byte slots. The all-ones values
+	 * for the width are widened so they always compare equal to KH_HASH_EMPTY
+	 * and KH_HASH_DELETED.
+	 */
+	
+	switch (slot_size) {
+		case 1: {
+			uint8_t value = ((const uint8_t *) slots)[i];
+			return (value >= UINT8_MAX - 1) ? (KH_HASH_EMPTY - (UINT8_MAX - value)) : value;
+		}
+		case 2: {
+			uint16_t value = ((const uint16_t *) slots)[i];
+			return (value >= UINT16_MAX - 1) ? (KH_HASH_EMPTY - (UINT16_MAX - value)) : value;
+		}
+		case 4: {
+			uint32_t value = ((const uint32_t *) slots)[i];
+			return (value >= UINT32_MAX - 1) ? (KH_HASH_EMPTY - (UINT32_MAX - value)) : value;
+		}
+		default: {
+			return (KH_Slot) ((const uint64_t *) slots)[i];
+		}
+	}
+}
+
+static void KH_SetSlot(void *slots, uint32_t slot_size, size_t i, KH_Slot value) {
+	// Truncating KH_HASH_EMPTY and KH_HASH_DELETED gives the all-ones values
+	// for the width, which is what KH_GetSlot expects.
+	switch (slot_size) {
+		case 1: ((uint8_t *) slots)[i] = (uint8_t) value; break;
+		case 2: ((uint16_t *) slots)[i] = (uint16_t) value; break;
+		case 4: ((uint32_t *) slots)[i] = (uint32_t) value; break;
+		default: ((uint64_t *) slots)[i] = (uint64_t) value; break;
+	}
+}
+
+static size_t KH_FindFreeSlot(const void *slots, uint32_t slot_size, size_t nslots, kh_hash_t hash) {
+	/**
+	 * Return the first empty or deleted slot for the hash.
+	 */
+	
+	size_t slot_index = KH_BlobStartingIndexForSize(hash, nslots);
+	
+	while (1) {
+		KH_Slot slot = KH_GetSlot(slots, slot_size, slot_index);
+		
+		if (slot == KH_HASH_EMPTY || slot == KH_HASH_DELETED) {
+			return slot_index;
+		}
+		
+		slot_index = (slot_index + 1) & (nslots - 1);
+	}
+}
+
+static size_t KH_InsertSlot(void *slots, uint32_t slot_size, size_t nslots, kh_hash_t hash, size_t index) {
+	/**
+	 * Put index in the first free slot for the hash, and return which slot
+	 * that was.
+	 */
+	
+	size_t slot_index = KH_FindFreeSlot(slots, slot_size, nslots, hash);
+	KH_SetSlot(slots, slot_size, slot_index, index);
+	return slot_index;
+}
+
+static size_t KH_ProbeLimitForSize(size_t size) {
+	/**
+	 * The longest probe an insert should need with a decent hash. Linear
+	 * probing at our load factor gives a longest run of about 7 * log2(size)
+	 * slots, so anything much longer means the keys were chosen to collide.
+	 */
+	
+	size_t limit = 32;
+	
+	for (size_t i = size; i > 1; i >>= 1) {
+		limit += 16;
+	}
+	
+	return limit;
+}
+
+static kh_hash_t KH_DictHashKey(KH_Dict *self, KH_Blob *key) {
+	/**
+	 * Hash a key the way this dict does. Keyed hashes depend on the dict's
+	 * seed so they aren't cached in the blob.
+	 */
+	
+	if (self->flags & KH_DICT_KEYED) {
+		return KH_SipHash(self->seed, key->data, key->length);
+	}
+	
+	return KH_BlobHash(key, self->flags & KH_DICT_CRC32C);
+}
+
+#ifdef KHASHTABLE_THREADS
+// Tables with fewer pairs than this are always indexed on one thread
+#ifndef KH_PARALLEL_REHASH_MIN
+#define KH_PARALLEL_REHASH_MIN 65536
+#endif
+
+typedef struct KH_RehashJob {
+	const KH_DictPair *pairs;
+	size_t count;
+	void *slots;
+	uint32_t slot_size;
+	size_t nslots;
+	size_t threads;
+	size_t region_size; // Each thread owns this many slots
+	size_t *cursors; // threads * threads, pairs per (thread, region) then write positions
+	size_t *region_start; // threads + 1, where each region's pairs start in order
+	size_t *overflow; // threads, pairs that ran off the end of each region
+	size_t *order; // count, pair indexes grouped by region
+	int phase;
+} KH_RehashJob;
+
+typedef struct KH_RehashWorker {
+	KH_RehashJob *job;
+	size_t id;
+} KH_RehashWorker;
+
+static void *KH_RehashWork(void *data) {
+	/**
+	 * One thread's share of a phase of KH_IndexPairsParallel.
+	 */
+	
+	KH_RehashWorker *worker = data;
+	KH_RehashJob *job = worker->job;
+	size_t t = worker->id;
+	size_t T = job->threads;
+	size_t mask = job->nslots - 1;
+	
+	switch (job->phase) {
+		// Count how many of our chunk of the pairs start in each region
+		case 0:
+		// Write the indexes of those pairs to their regions' part of order
+		case 1: {
+			size_t *cursors = &job->cursors[t * T];
+			
+			for (size_t i = job->count * t / T; i < job->count * (t + 1) / T; i++) {
+				size_t r = ((size_t) job->pairs[i].hash & mask) / job->region_size;
+				
+				if (job->phase == 0) {
+					cursors[r]++;
+				}
+				else {
+					job->order[cursors[r]++] = i;
+				}
+			}
+			
+			break;
+		}
+		
+		// Insert the pairs of our region without probing past its end. Those
+		// which would have to are kept at the start of our part of order.
+		case 2: {
+			size_t hi = (t + 1) * job->region_size;
+			size_t *order = &job->order[job->region_start[t]];
+			size_t n = job->region_start[t + 1] - job->region_start[t];
+			size_t overflow = 0;
+			
+			if (hi > job->nslots) {
+				hi = job->nslots;
+			}
+			
+			for (size_t k = 0; k < n; k++) {
+				size_t i = order[k];
+				size_t slot_index = (size_t) job->pairs[i].hash & mask;
+				
+				while (slot_index < hi && KH_GetSlot(job->slots, job->slot_size, slot_index) != KH_HASH_EMPTY) {
+					slot_index++;
+				}
+				
+				if (slot_index < hi) {
+					KH_SetSlot(job->slots, job->slot_size, slot_index, i);
+				}
+				else {
+					order[overflow++] = i;
+				}
+			}
+			
+			job->overflow[t] = overflow;
+			
+			break;
+		}
+	}
+	
+	return NULL;
+}
+
+static void KH_RunRehashPhase(KH_RehashJob *job, int phase, KH_RehashWorker *workers, pthread_t *handles) {
+	/**
+	 * Run a phase on all threads. Any thread which can't be started has its
+	 * share done on this one instead.
+	 */
+	
+	job->phase = phase;
+	
+	for (size_t t = 1; t < job->threads; t++) {
+		if (pthread_create(&handles[t], NULL, KH_RehashWork, &workers[t])) {
+			KH_RehashWork(&workers[t]);
+			workers[t].job = NULL;
+		}
+	}
+	
+	KH_RehashWork(&workers[0]);
+	
+	for (size_t t = 1; t < job->threads; t++) {
+		if (workers[t].job) {
+			pthread_join(handles[t], NULL);
+		}
+		
+		workers[t].job = job;
+	}
+}
+
+static bool KH_IndexPairsParallel(KH_Dict *self, const KH_DictPair *pairs, size_t count, void *slots, uint32_t slot_size, size_t nslots) {
+	/**
+	 * Index pairs into empty slots using self->threads threads. The slots are
+	 * split into one contiguous region per thread, the pairs are grouped by
+	 * the region they start probing in, and each thread fills its own region.
+	 * Pairs whose probe runs off the end of their region are inserted on this
+	 * thread afterwards, which leaves the same kind of table a serial build
+	 * would. Returns false without touching the slots if it can't allocate
+	 * its scratch memory.
+	 */
+	
+	size_t T = self->threads;
+	
+	if (T > nslots) {
+		T = nslots;
+	}
+	
+	KH_RehashJob job = {
+		.pairs = pairs,
+		.count = count,
+		.slots = slots,
+		.slot_size = slot_size,
+		.nslots = nslots,
+		.threads = T,
+		.region_size = (nslots + T - 1) / T,
+	};
+	
+	job.cursors = KH_Alloc(self->allocator, sizeof *job.cursors * (T * T + 2 * T + 1));
+	job.order = KH_Alloc(self->allocator, sizeof *job.order * count);
+	KH_RehashWorker *workers = KH_Alloc(self->allocator, sizeof *workers * T);
+	pthread_t *handles = KH_Alloc(self->allocator, sizeof *handles * T);
+	
+	if (!job.cursors || !job.order || !workers || !handles) {
+		KH_Free(self->allocator, job.cursors);
+		KH_Free(self->allocator, job.order);
+		KH_Free(self->allocator, workers);
+		KH_Free(self->allocator, handles);
+		return false;
+	}
+	
+	memset(job.cursors, 0, sizeof *job.cursors * T * T);
+	job.region_start = &job.cursors[T * T];
+	job.overflow = &job.region_start[T + 1];
+	
+	for (size_t t = 0; t < T; t++) {
+		workers[t].job = &job;
+		workers[t].id = t;
+	}
+	
+	KH_RunRehashPhase(&job, 0, workers, handles);
+	
+	// Turn the counts into write positions, grouping by region and then by
+	// thread so every region's pairs stay in their original order
+	size_t position = 0;
+	
+	for (size_t r = 0; r < T; r++) {
+		job.region_start[r] = position;
+		
+		for (size_t t = 0; t < T; t++) {
+			size_t n = job.cursors[t * T + r];
+			job.cursors[t * T + r] = position;
+			position += n;
+		}
+	}
+	
+	job.region_start[T] = position;
+	
+	KH_RunRehashPhase(&job, 1, workers, handles);
+	KH_RunRehashPhase(&job, 2, workers, handles);
+	
+	for (size_t r = 0; r < T; r++) {
+		for (size_t k = 0; k < job.overflow[r]; k++) {
+			size_t i = job.order[job.region_start[r] + k];
+			KH_InsertSlot(slots, slot_size, nslots, pairs[i].hash, i);
+		}
+	}
+	
+	KH_Free(self->allocator, job.cursors);
+	KH_Free(self->allocator, job.order);
+	KH_Free(self->allocator, workers);
+	KH_Free(self->allocator, handles);
+	
+	return true;
+}
+#endif
+
+static void KH_IndexPairs(KH_Dict *self, const KH_DictPair *pairs, size_t count, void *slots, uint32_t slot_size, size_t nslots) {
+	/**
+	 * Index count pairs into empty slots, using several threads for big
+	 * tables if the dict was set up to.
+	 */
+	
+#ifdef KHASHTABLE_THREADS
+	if (self->threads > 1 && count >= KH_PARALLEL_REHASH_MIN) {
+		if (KH_IndexPairsParallel(self, pairs, count, slots, slot_size, nslots)) {
+			return;
+		}
+	}
+#else
+	(void) self;
+#endif
+	
+	for (size_t i = 0; i < count; i++) {
+		KH_InsertSlot(slots, slot_size, nslots, pairs[i].hash, i);
+	}
+}
+
+static uint64_t KH_BeginEvent(KH_Dict *self, KH_DictEvent *event, int kind, size_t new_capacity) {
+	/**
+	 * Fill in the event and call the dict's before hook, returning the time
+	 * to pass to KH_EndEvent. Nothing is timed when there are no hooks.
+	 */
+	
+	if (!self->before_event && !self->after_event) {
+		return 0;
+	}
+	
+	event->kind = kind;
+	event->old_capacity = self->pairs_alloced;
+	event->new_capacity = new_capacity;
+	event->count = self->data_count;
+	event->tombstones = self->tombstone_count;
+	event->elapsed = 0;
+	event->failed = false;
+	
+	if (self->before_event) {
+		self->before_event(self->event_context, self, event);
+	}
+	
+	return KH_Nanoseconds();
+}
+
+static void KH_EndEvent(KH_Dict *self, KH_DictEvent *event, uint64_t start, bool failed) {
+	/**
+	 * Update the event to how things ended up and call the after hook.
+	 */
+	
+	if (!self->after_event) {
+		return;
+	}
+	
+	event->elapsed = KH_Nanoseconds() - start;
+	event->new_capacity = self->pairs_alloced;
+	event->count = self->data_count;
+	event->tombstones = self->tombstone_count;
+	event->failed = failed;
+	
+	self->after_event(self->event_context, self, event);
+}
+
+static bool KH_ResizeExpiry(KH_Dict *self, size_t count) {
+	/**
+	 * Resize the expiry times, if the dict has any, to count pairs. This is
+	 * done before the pairs grow and after they shrink, so there is always a
+	 * time for every pair: failing to shrink just leaves them a bit bigger
+	 * than needed. Returns false if growing them fails.
+	 */
+	
+	if (!self->expiry) {
+		return true;
+	}
+	
+	if (!count) {
+		KH_FreeTable(self, self->expiry);
+		self->expiry = NULL;
+		return true;
+	}
+	
+	uint64_t *expiry = KH_ReallocTable(self, self->expiry, sizeof *expiry * count);
+	
+	if (!expiry) {
+		return count <= self->pairs_alloced;
+	}
+	
+	if (count > self->pairs_alloced) {
+		memset(&expiry[self->pairs_alloced], 0, sizeof *expiry * (count - self->pairs_alloced));
+	}
+	
+	self->expiry = expiry;
+	
+	return true;
+}
+
+static bool KH_CompactPairs(KH_Dict *self) {
+	/**
+	 * Close up the holes left in the pairs by deletes, keeping the order of
+	 * the entries. The slots must be rebuilt afterwards if anything moved,
+	 * which is what this returns.
+	 */
+	
+	if (self->pairs_used == self->data_count) {
+		return false;
+	}
+	
+	size_t count = 0;
+	
+	for (size_t i = self->pairs_head; i < self->pairs_used; i++) {
+		if (self->pairs[i].key) {
+			if (self->expiry) {
+				self->expiry[count] = self->expiry[i];
+			}
+			
+			self->pairs[count++] = self->pairs[i];
+		}
+	}
+	
+	memset(&self->pairs[count], 0, sizeof *self->pairs * (self->pairs_used - count));
+	
+	if (self->expiry) {
+		memset(&self->expiry[count], 0, sizeof *self->expiry * (self->pairs_used - count));
+	}
+	
+	self->pairs_used = count;
+	self->pairs_head = 0;
+	
+	return true;
+}
+
+static void KH_IndexSlots(KH_Dict *self) {
+	/**
+	 * Compact the pairs and index them again in the current slots.
+	 */
+	
+	KH_CompactPairs(self);
+	memset(self->slots, 0xff, self->slot_size * self->data_alloced);
+	KH_IndexPairs(self, self->pairs, self->data_count, self->slots, self->slot_size, self->data_alloced);
+	self->tombstone_count = 0;
+}
+
+static void KH_RebuildSlots(KH_Dict *self, bool rehash) {
+	/**
+	 * Re-index all pairs without changing the size of the table, which also
+	 * gets rid of any deleted slots and holes in the pairs. The keys are
+	 * hashed again if rehash is set, otherwise their stored hashes are used.
+	 */
+	
+	KH_DictEvent event;
+	uint64_t start = KH_BeginEvent(self, &event, rehash ? KH_DICT_EVENT_RESEED : KH_DICT_EVENT_REHASH, self->pairs_alloced);
+	
+	if (rehash) {
+		for (size_t i = self->pairs_head; i < self->pairs_used; i++) {
+			if (self->pairs[i].key) {
+				self->pairs[i].hash = KH_DictHashKey(self, self->pairs[i].key);
+			}
+		}
+	}
+	
+	KH_IndexSlots(self);
+	
+	KH_EndEvent(self, &event, start, false);
+}
+
+static void KH_ReseedDict(KH_Dict *self) {
+	/**
+	 * Switch the dict to keyed hashing with a fresh seed and rehash every key.
+	 * Done when inserts start needing pathologically long probes.
+	 */
+	
+	self->flags |= KH_DICT_KEYED;
+	self->reseed_size = self->data_alloced;
+	KH_RandomSeed(self);
+	KH_RebuildSlots(self, true);
+}
+
+static KH_Dict *KH_ResizeTiny(KH_Dict *self, size_t new_alloced) {
+	/**
+	 * Make the dict a tiny dict with room for new_alloced pairs, dropping its
+	 * slots if it had any.
+	 */
+	
+	KH_DictEvent event;
+	uint64_t start = KH_BeginEvent(self, &event, KH_DICT_EVENT_RESIZE, new_alloced);
+	KH_DictPair *new_pairs = NULL;
+	
+	if (new_alloced > self->pairs_alloced && !KH_ResizeExpiry(self, new_alloced)) {
+		KH_EndEvent(self, &event, start, true);
+		return NULL;
+	}
+	
+	// Coming from an indexed dict, the pairs may have holes, so the live ones
+	// are copied to a new array rather than cut off by a realloc.
+	if (new_alloced && self->slots) {
+		new_pairs = KH_AllocTable(self, sizeof *self->pairs * new_alloced);
+		
+		if (!new_pairs) {
+			KH_EndEvent(self, &event, start, true);
+			return NULL;
+		}
+		
+		size_t count = 0;
+		
+		for (size_t i = self->pairs_head; i < self->pairs_used; i++) {
+			if (self->pairs[i].key) {
+				if (self->expiry) {
+					self->expiry[count] = self->expiry[i];
+				}
+				
+				new_pairs[count++] = self->pairs[i];
+			}
+		}
+		
+		memset(&new_pairs[count], 0, sizeof *new_pairs * (new_alloced - count));
+		
+		if (self->expiry) {
+			memset(&self->expiry[count], 0, sizeof *self->expiry * (self->pairs_used - count));
+		}
+		
+		KH_FreeTable(self, self->pairs);
+	}
+	else if (new_alloced) {
+		new_pairs = KH_ReallocTable(self, self->pairs, sizeof *self->pairs * new_alloced);
+		
+		if (!new_pairs) {
+			KH_EndEvent(self, &event, start, true);
+			return NULL;
+		}
+	}
+	else {
+		KH_FreeTable(self, self->pairs);
+	}
+	
+	// Init new pairs to empty (NULL)
+	if (new_alloced > self->pairs_alloced) {
+		memset(&new_pairs[self->pairs_alloced], 0, sizeof *self->pairs * (new_alloced - self->pairs_alloced));
+	}
+	else {
+		KH_ResizeExpiry(self, new_alloced);
+	}
+	
+	KH_FreeTable(self, self->slots);
+	self->slots = NULL;
+	self->slot_size = 0;
+	self->pairs = new_pairs;
+	self->pairs_alloced = new_alloced;
+	self->pairs_used = self->data_count;
+	self->pairs_head = 0;
+	self->data_alloced = 0;
+	self->tombstone_count = 0;
+	
+	KH_EndEvent(self, &event, start, false);
+	
+	return self;
+}
+
+static KH_Dict *KH_ResizeIndexed(KH_Dict *self, size_t new_size) {
+	/**
+	 * Give the dict new_size slots, which must be a power of two with room for
+	 * all of its pairs, and resize the pairs to match.
+	 */
+	
+	size_t new_usable = KH_UsableForSize(new_size);
+	KH_DictEvent event;
+	uint64_t start = KH_BeginEvent(self, &event, KH_DICT_EVENT_RESIZE, new_usable);
+	
+	// Use the smallest slots that work, so small dicts have tiny indexes
+	uint32_t slot_size = KH_SlotSizeForSize(new_size);
+	
+	// Close up any holes first, so the pairs fit in new_usable and can be
+	// indexed in order. If we fail after this, the old slots have to be
+	// rebuilt for the new positions.
+	bool compacted = KH_CompactPairs(self);
+	
+	// Alloc new slots and resize the pair data in place if possible, since
+	// the pairs keep their order and indexes
+	void *new_slots = NULL;
+	
+	if (new_usable <= self->pairs_alloced || KH_ResizeExpiry(self, new_usable)) {
+		new_slots = KH_AllocTable(self, slot_size * new_size);
+	}
+	
+	if (!new_slots) {
+		if (compacted) {
+			KH_IndexSlots(self);
+		}
+		
+		KH_EndEvent(self, &event, start, true);
+		return NULL;
+	}
+	
+	KH_DictPair *new_pairs = KH_ReallocTable(self, self->pairs, sizeof *self->pairs * new_usable);
+	
+	if (!new_pairs) {
+		KH_FreeTable(self, new_slots);
+		
+		if (compacted) {
+			KH_IndexSlots(self);
+		}
+		
+		KH_EndEvent(self, &event, start, true);
+		return NULL;
+	}
+	
+	// Init slots to empty (all ones)
+	memset(new_slots, 0xff, slot_size * new_size);
+	
+	// Init new pairs to empty (NULL)
+	if (new_usable > self->pairs_alloced) {
+		memset(&new_pairs[self->pairs_alloced], 0, sizeof *self->pairs * (new_usable - self->pairs_alloced));
+	}
+	else {
+		KH_ResizeExpiry(self, new_usable);
+	}
+	
+	// Index the pairs in the new slots
+	KH_IndexPairs(self, new_pairs, self->data_count, new_slots, slot_size, new_size);
+	
+	// We should be ready to free old stuff, place new stuff
+	KH_FreeTable(self, self->slots);
+	self->slots = new_slots;
+	self->slot_size = slot_size;
+	self->pairs = new_pairs;
+	self->pairs_alloced = new_usable;
+	self->data_alloced = new_size;
+	self->tombstone_count = 0;
+	
+	KH_EndEvent(self, &event, start, false);
+	
+	return self;
+}
+
+static size_t KH_SizeForCount(size_t count) {
+	/**
+	 * Return the smallest number of slots which can hold count pairs, or
+	 * zero if the tables for that many couldn't even be sized without
+	 * overflowing.
+	 */
+	
+	size_t size = 8;
+	
+	while (KH_UsableForSize(size) < count) {
+		if (size > SIZE_MAX / (2 * sizeof (KH_DictPair))) {
+			return 0;
+		}
+		
+		size *= 2;
+	}
+	
+	return size;
+}
+
+static KH_Dict *KH_ResizeDict(KH_Dict *self) {
+	/**
+	 * Grow a dict, or if it has size zero, allocate the initial memory. Tiny
+	 * dicts only grow their pairs until they hold KH_TINY_DICT_SIZE entries,
+	 * and get slots after that.
+	 */
+	
+	KH_STAT_BEGIN();
+	KH_Dict *result;
+	
+	if (!self->slots && self->pairs_alloced < KH_TINY_DICT_SIZE) {
+		size_t new_alloced = (self->pairs_alloced) ? (2 * self->pairs_alloced) : (4);
+		
+		if (new_alloced > KH_TINY_DICT_SIZE) {
+			new_alloced = KH_TINY_DICT_SIZE;
+		}
+		
+		result = KH_ResizeTiny(self, new_alloced);
+	}
+	
+	// A dict leaving tiny mode gets the smallest table that has room to grow
+	else if (!self->data_alloced) {
+		result = KH_ResizeIndexed(self, KH_SizeForCount(self->data_count + 1));
+	}
+	
+	else {
+		result = KH_ResizeIndexed(self, 2 * self->data_alloced);
+	}
+	
+	KH_STAT_END(KH_STAT_RESIZE);
+	
+	return result;
+}
+
+static KH_Dict *KH_ShrinkDict(KH_Dict *self, size_t room) {
+	/**
+	 * Shrink the dict to the smallest size that has room for this many pairs,
+	 * if that is smaller than it is now. Deleted slots are cleaned up even if
+	 * the size doesn't change.
+	 */
+	
+	if (room <= KH_TINY_DICT_SIZE) {
+		if (!self->slots && self->pairs_alloced <= room) {
+			return self;
+		}
+		
+		return KH_ResizeTiny(self, room);
+	}
+	
+	size_t new_size = KH_SizeForCount(room);
+	
+	if (!self->slots || new_size >= self->data_alloced) {
+		if (self->slots && (self->tombstone_count || self->pairs_used != self->data_count)) {
+			KH_RebuildSlots(self, false);
+		}
+		
+		return self;
+	}
+	
+	return KH_ResizeIndexed(self, new_size);
+}
+
+static bool KH_DictMakeRoom(KH_Dict *self) {
+	/**
+	 * Make room to append a pair once the pair array is used up, by closing
+	 * up the holes left by deletes if there are enough of them to be worth
+	 * it, and by growing otherwise. Pair indexes and slot positions found
+	 * before this may no longer be valid. Returns false if it fails to
+	 * allocate memory.
+	 */
+	
+	size_t holes = self->pairs_used - self->data_count;
+	
+	if (holes && holes >= self->pairs_alloced / 4) {
+		KH_RebuildSlots(self, false);
+		return true;
+	}
+	
+	return KH_ResizeDict(self) != NULL;
+}
+
+static bool KH_DictInsert(KH_Dict *self, KH_Blob *key, KH_Blob *value, kh_hash_t hash, size_t slot_index) {
+	/**
+	 * Insert an entry into the hash table. The key must not exist, and hash
+	 * must be its hash from KH_DictHashKey. slot_index is the free slot found
+	 * while probing for the key, or KH_NOT_FOUND if it should be probed for
+	 * again.
+	 */
+	
+	// Compact or resize if the pair array is used up
+	if (self->pairs_used >= self->pairs_alloced) {
+		if (!KH_DictMakeRoom(self)) {
+			return false;
+		}
+		
+		// The slot we found before no longer means anything
+		slot_index = KH_NOT_FOUND;
+	}
+	
+	// If deleted slots have piled up so much that the table is as full as it
+	// would be before a resize, clean them up so misses still end quickly.
+	else if (self->slots && self->data_count + self->tombstone_count >= self->pairs_alloced) {
+		KH_RebuildSlots(self, false);
+		slot_index = KH_NOT_FOUND;
+	}
+	
+	self->pairs[self->pairs_used].key = key;
+	self->pairs[self->pairs_used].value = value;
+	self->pairs[self->pairs_used].hash = hash;
+	
+	if (self->expiry) {
+		self->expiry[self->pairs_used] = 0;
+	}
+	
+	// Tiny dicts don't have any slots to update
+	if (self->slots) {
+		if (slot_index == KH_NOT_FOUND) {
+			slot_index = KH_FindFreeSlot(self->slots, self->slot_size, self->data_alloced, hash);
+		}
+		
+		if (KH_GetSlot(self->slots, self->slot_size, slot_index) == KH_HASH_DELETED) {
+			self->tombstone_count--;
+		}
+		
+		KH_SetSlot(self->slots, self->slot_size, slot_index, self->pairs_used);
+	}
+	
+	self->pairs_used++;
+	self->data_count++;
+	
+	// If the key landed too far from where it started probing, someone is
+	// probably feeding us colliding keys. Rehash with a secret seed, at most
+	// once per table size so honest bad luck can't make us thrash.
+	if (self->slots && self->reseed_size != self->data_alloced) {
+		size_t distance = (slot_index - KH_BlobStartingIndexForSize(hash, self->data_alloced)) & (self->data_alloced - 1);
+		
+		if (distance > KH_ProbeLimitForSize(self->data_alloced)) {
+			KH_ReseedDict(self);
+		}
+	}
+	
+	return true;
+}
+
+static void KH_DictChange(KH_Dict *self, size_t index, KH_Blob *value) {
+	/**
+	 * Change the value for a key that already exists, given the index to the
+	 * key. The entry no longer expires.
+	 */
+	
+	KH_ReleaseBlob(self->pairs[index].value);
+	self->pairs[index].value = value;
+	
+	if (self->expiry) {
+		self->expiry[index] = 0;
+	}
+}
+
+static size_t KH_DictProbe(KH_Dict *self, KH_Blob *key, kh_hash_t hash, size_t *free_slot) {
+	/**
+	 * Find the index of a pair given its key and KH_DictHashKey hash. Returns
+	 * the index or KH_NOT_FOUND if none was found. If free_slot isn't NULL, it
+	 * is set to the first empty or deleted slot seen along the way, which is
+	 * where the key would be inserted, or KH_NOT_FOUND if there was no such
+	 * slot.
+	 */
+	
+	size_t first_free = KH_NOT_FOUND;
+	
+	// Tiny dicts are just scanned, using the hashes in the pairs to skip
+	// most of the keys without loading them.
+	if (!self->slots) {
+		for (size_t i = 0; i < self->data_count; i++) {
+			if (self->pairs[i].hash == hash && KH_BlobEqual(key, self->pairs[i].key)) {
+				return i;
+			}
+		}
+		
+		if (free_slot) {
+			*free_slot = KH_NOT_FOUND;
+		}
+		
+		return KH_NOT_FOUND;
+	}
+	
+	size_t slot_index = KH_BlobStartingIndexForSize(hash, self->data_alloced);
+	
+	for (size_t i = 0; i < self->data_alloced; i++) {
+		size_t current = (slot_index + i) & (self->data_alloced - 1);
+		KH_Slot slot = KH_GetSlot(self->slots, self->slot_size, current);
+		
+		// Empty, never-used slot which won't have anything we're looking for
+		// located after it
+		if (slot == KH_HASH_EMPTY) {
+			if (first_free == KH_NOT_FOUND) {
+				first_free = current;
+			}
+			
+			break;
+		}
+		
+		// Once used slot which may still have hits after it
+		if (slot == KH_HASH_DELETED) {
+			if (first_free == KH_NOT_FOUND) {
+				first_free = current;
+			}
+			
+			continue;
+		}
+		
+		// If the key we're looking up matches the key indexed by the current
+		// slot, this is a hit and it should be returned.
+		if (self->pairs[slot].hash == hash && KH_BlobEqual(key, self->pairs[slot].key)) {
+			return slot;
+		}
+	}
+	
+	if (free_slot) {
+		*free_slot = first_free;
+	}
+	
+	return KH_NOT_FOUND;
+}
+
+static size_t KH_DictLookupIndex(KH_Dict *self, KH_Blob *key) {
+	/**
+	 * Find the index of a pair given its key. Returns the index or KH_NOT_FOUND
+	 * if none was found.
+	 */
+	
+	return KH_DictProbe(self, key, KH_DictHashKey(self, key), NULL);
+}
+
+static size_t KH_DictSlotForIndex(KH_Dict *self, size_t index) {
+	/**
+	 * Find the position of the slot which indexes the given pair, by probing
+	 * for its stored hash.
+	 */
+	
+	size_t slot_index = KH_BlobStartingIndexForSize(self->pairs[index].hash, self->data_alloced);
+	
+	while (KH_GetSlot(self->slots, self->slot_size, slot_index) != index) {
+		slot_index = (slot_index + 1) & (self->data_alloced - 1);
+	}
+	
+	return slot_index;
+}
+
+static void KH_DictSkipHoles(KH_Dict *self) {
+	/**
+	 * Move the head and end of the pairs past any holes there, so the oldest
+	 * and newest entries can be found in O(1) and new pairs are appended
+	 * right after the newest one.
+	 */
+	
+	if (!self->data_count) {
+		self->pairs_head = 0;
+		self->pairs_used = 0;
+		return;
+	}
+	
+	while (!self->pairs[self->pairs_head].key) {
+		self->pairs_head++;
+	}
+	
+	while (!self->pairs[self->pairs_used - 1].key) {
+		self->pairs_used--;
+	}
+}
+
+static size_t KH_DictPromote(KH_Dict *self, size_t index) {
+	/**
+	 * Move the pair at index to the end, making it the newest entry, and
+	 * return its new index. If there's no room to move it and none can be
+	 * made, it stays where it is.
+	 */
+	
+	if (index == self->pairs_used - 1) {
+		return index;
+	}
+	
+	KH_DictPair pair = self->pairs[index];
+	uint64_t expiry = self->expiry ? self->expiry[index] : 0;
+	
+	// Tiny dicts have no holes and only a few pairs, so just shift them
+	if (!self->slots) {
+		memmove(&self->pairs[index], &self->pairs[index + 1], sizeof *self->pairs * (self->data_count - index - 1));
+		self->pairs[self->data_count - 1] = pair;
+		
+		if (self->expiry) {
+			memmove(&self->expiry[index], &self->expiry[index + 1], sizeof *self->expiry * (self->data_count - index - 1));
+			self->expiry[self->data_count - 1] = expiry;
+		}
+		
+		return self->data_count - 1;
+	}
+	
+	if (self->pairs_used >= self->pairs_alloced) {
+		// This moves the pairs around even if it fails
+		bool made_room = KH_DictMakeRoom(self);
+		index = KH_DictProbe(self, pair.key, pair.hash, NULL);
+		
+		if (!made_room || index == self->pairs_used - 1) {
+			return index;
+		}
+	}
+	
+	KH_SetSlot(self->slots, self->slot_size, KH_DictSlotForIndex(self, index), self->pairs_used);
+	memset(&self->pairs[index], 0, sizeof *self->pairs);
+	
+	if (self->expiry) {
+		self->expiry[index] = 0;
+		self->expiry[self->pairs_used] = expiry;
+	}
+	
+	self->pairs[self->pairs_used++] = pair;
+	KH_DictSkipHoles(self);
+	
+	return self->pairs_used - 1;
+}
+
+static void KH_DictRemove(KH_Dict *self, size_t index) {
+	/**
+	 * Deletes the value at the given index, and updates the slots as needed.
+	 */
+	
+	// Free key and value, they arent needed anymore
+	KH_ReleaseBlob(self->pairs[index].key);
+	KH_ReleaseBlob(self->pairs[index].value);
+	
+	// Tiny dicts have no slots to fix up, so the pairs after are just moved
+	// down over it
+	if (!self->slots) {
+		memmove(&self->pairs[index], &self->pairs[index + 1], sizeof *self->pairs * (self->data_count - index - 1));
+		memset(&self->pairs[self->data_count - 1], 0, sizeof *self->pairs);
+		
+		if (self->expiry) {
+			memmove(&self->expiry[index], &self->expiry[index + 1], sizeof *self->expiry * (self->data_count - index - 1));
+			self->expiry[self->data_count - 1] = 0;
+		}
+		
+		self->data_count--;
+		self->pairs_used--;
+	}
+	
+	// Otherwise the pair is left as a hole, so nothing else has to move. The
+	// holes are closed up the next time the slots are rebuilt.
+	else {
+		KH_SetSlot(self->slots, self->slot_size, KH_DictSlotForIndex(self, index), KH_HASH_DELETED);
+		self->tombstone_count++;
+		memset(&self->pairs[index], 0, sizeof *self->pairs);
+		
+		if (self->expiry) {
+			self->expiry[index] = 0;
+		}
+		
+		self->data_count--;
+		KH_DictSkipHoles(self);
+	}
+	
+	// Shrink once the dict is a quarter full, to a size where it's half full.
+	// Growing again needs it to double, so it can't thrash around one size.
+	if ((self->flags & KH_DICT_AUTO_SHRINK) && self->slots && self->data_count < self->pairs_alloced / 4) {
+		KH_ShrinkDict(self, 2 * self->data_count);
+	}
+}
+
+static bool KH_DictExpired(KH_Dict *self, size_t index) {
+	// The clock is only read for entries that can expire
+	return self->expiry && self->expiry[index] && self->expiry[index] <= KH_Nanoseconds();
+}
+
+static size_t KH_DictLookupLive(KH_Dict *self, KH_Blob *key) {
+	/**
+	 * Like KH_DictLookupIndex, but an expired entry is removed when it's
+	 * found and reported as missing.
+	 */
+	
+	size_t index = KH_DictLookupIndex(self, key);
+	
+	if (index != KH_NOT_FOUND && KH_DictExpired(self, index)) {
+		KH_DictRemove(self, index);
+		return KH_NOT_FOUND;
+	}
+	
+	return index;
+}
+
+static void KH_DictForget(KH_Dict *self) {
+	/**
+	 * Empty the dict without releasing any blobs, for when they have been
+	 * released or handed to someone else already.
+	 */
+	
+	if (self->pairs) {
+		memset(self->pairs, 0, sizeof *self->pairs * self->pairs_used);
+	}
+	
+	if (self->expiry) {
+		memset(self->expiry, 0, sizeof *self->expiry * self->pairs_used);
+	}
+	
+	if (self->slots) {
+		memset(self->slots, 0xff, self->slot_size * self->data_alloced);
+	}
+	
+	self->data_count = 0;
+	self->pairs_used = 0;
+	self->pairs_head = 0;
+	self->tombstone_count = 0;
+}
+
+KH_Dict *KH_CreateDict(void) {
+	return KH_CreateDictWithOptions(NULL);
+}
+
+KH_Dict *KH_CreateDictWithOptions(const KH_DictOptions *options) {
+	const KH_Allocator *allocator = options ? options->allocator : NULL;
+	KH_Dict *dict = KH_Alloc(allocator, sizeof *dict);
+	
+	if (!dict) {
+		return NULL;
+	}
+	
+	memset(dict, 0, sizeof *dict);
+	dict->allocator = allocator;
+	dict->flags = options ? options->flags : 0;
+	dict->threads = options ? options->threads : 0;
+	
+	if (dict->flags & KH_DICT_KEYED) {
+		if (options->seed[0] || options->seed[1]) {
+			dict->seed[0] = options->seed[0];
+			dict->seed[1] = options->seed[1];
+		}
+		else {
+			KH_RandomSeed(dict);
+		}
+	}
+	
+	return dict;
+}
+
+KH_Dict *KH_DictClone(KH_Dict *self) {
+	/**
+	 * Make a copy of a dict by copying its slots and pairs as they are. The
+	 * blobs are shared with the original instead of being copied.
+	 */
+	
+	KH_Dict *clone = KH_Alloc(self->allocator, sizeof *clone);
+	
+	if (!clone) {
+		return NULL;
+	}
+	
+	*clone = *self;
+	clone->slots = NULL;
+	clone->pairs = NULL;
+	clone->expiry = NULL;
+	
+	if (self->slots) {
+		clone->slots = KH_AllocTable(clone, self->slot_size * self->data_alloced);
+		
+		if (!clone->slots) {
+			KH_Free(self->allocator, clone);
+			return NULL;
+		}
+		
+		memcpy(clone->slots, self->slots, self->slot_size * self->data_alloced);
+	}
+	
+	if (self->pairs) {
+		clone->pairs = KH_AllocTable(clone, sizeof *self->pairs * self->pairs_alloced);
+		
+		if (!clone->pairs) {
+			KH_FreeTable(clone, clone->slots);
+			KH_Free(self->allocator, clone);
+			return NULL;
+		}
+		
+		memcpy(clone->pairs, self->pairs, sizeof *self->pairs * self->pairs_alloced);
+	}
+	
+	if (self->expiry) {
+		clone->expiry = KH_AllocTable(clone, sizeof *self->expiry * self->pairs_alloced);
+		
+		if (!clone->expiry) {
+			KH_FreeTable(clone, clone->pairs);
+			KH_FreeTable(clone, clone->slots);
+			KH_Free(self->allocator, clone);
+			return NULL;
+		}
+		
+		memcpy(clone->expiry, self->expiry, sizeof *self->expiry * self->pairs_alloced);
+	}
+	
+	// Holes have NULL blobs, which are skipped by KH_RetainBlob
+	for (size_t i = self->pairs_head; i < self->pairs_used; i++) {
+		KH_RetainBlob(self->pairs[i].key);
+		KH_RetainBlob(self->pairs[i].value);
+	}
+	
+	return clone;
+}
+
+bool KH_DictReserve(KH_Dict *self, size_t count) {
+	/**
+	 * Make sure the dict can hold count entries without resizing.
+	 */
+	
+	if (count <= self->pairs_alloced) {
+		// Pairs can't be appended over holes, so close them up now if the
+		// new entries wouldn't fit after the last pair
+		if (count > self->data_count && self->pairs_used + (count - self->data_count) > self->pairs_alloced) {
+			KH_RebuildSlots(self, false);
+		}
+		
+		return true;
+	}
+	
+	if (!self->slots && count <= KH_TINY_DICT_SIZE) {
+		return KH_ResizeTiny(self, count) != NULL;
+	}
+	
+	size_t size = KH_SizeForCount(count);
+	
+	return size && KH_ResizeIndexed(self, size) != NULL;
+}
+
+static bool KH_DictSameHash(KH_Dict *self, KH_Dict *other) {
+	// Whether a key hashes to the same value in both dicts
+	if ((self->flags & KH_DICT_KEYED) != (other->flags & KH_DICT_KEYED)) {
+		return false;
+	}
+	
+	if (self->flags & KH_DICT_KEYED) {
+		return self->seed[0] == other->seed[0] && self->seed[1] == other->seed[1];
+	}
+	
+	return (self->flags & KH_DICT_CRC32C) == (other->flags & KH_DICT_CRC32C);
+}
+
+static bool KH_DictEnableExpiry(KH_Dict *self) {
+	/**
+	 * Allocate the expiry times the first time an entry is given one.
+	 */
+	
+	if (self->expiry) {
+		return true;
+	}
+	
+	size_t count = self->pairs_alloced ? self->pairs_alloced : 1;
+	self->expiry = KH_AllocTable(self, sizeof *self->expiry * count);
+	
+	if (!self->expiry) {
+		return false;
+	}
+	
+	memset(self->expiry, 0, sizeof *self->expiry * count);
+	
+	return true;
+}
+
+bool KH_DictUpdate(KH_Dict *self, KH_Dict *other, bool move, KH_DictConflictFunc resolve, void *context) {
+	/**
+	 * Set every entry of other in self. When a key is in both, resolve decides
+	 * whether to take the new value (NULL means always take it). With move,
+	 * other's blobs are moved instead of shared and other ends up empty.
+	 * Entries keep their expiry times, and ones which have expired already
+	 * are left out.
+	 */
+	
+	if (self == other) {
+		return true;
+	}
+	
+	// Make room up front, so nothing below can fail half way through
+	if (!KH_DictReserve(self, self->data_count + other->data_count)) {
+		return false;
+	}
+	
+	if (other->expiry && !KH_DictEnableExpiry(self)) {
+		return false;
+	}
+	
+	// Hashes stored in other can be reused if both dicts hash the same way
+	bool same_hash = KH_DictSameHash(self, other);
+	
+	for (size_t i = other->pairs_head; i < other->pairs_used; i++) {
+		KH_Blob *key = other->pairs[i].key;
+		KH_Blob *value = other->pairs[i].value;
+		
+		if (!key) {
+			continue;
+		}
+		
+		// Expired entries are as good as gone, they only haven't been swept
+		if (KH_DictExpired(other, i)) {
+			if (move) {
+				KH_ReleaseBlob(key);
+				KH_ReleaseBlob(value);
+			}
+			
+			continue;
+		}
+		
+		uint64_t expires = other->expiry ? other->expiry[i] : 0;
+		kh_hash_t hash = same_hash ? other->pairs[i].hash : KH_DictHashKey(self, key);
+		size_t free_slot;
+		size_t index = KH_DictProbe(self, key, hash, &free_slot);
+		
+		if (!move) {
+			KH_RetainBlob(key);
+			KH_RetainBlob(value);
+		}
+		
+		if (index == KH_NOT_FOUND) {
+			KH_DictInsert(self, key, value, hash, free_slot);
+			
+			// The new pair is still the last one even if the insert rebuilt
+			// the slots and closed up holes
+			if (self->expiry) {
+				self->expiry[self->pairs_used - 1] = expires;
+			}
+			
+			// Colliding keys can make the insert switch self to keyed
+			// hashing, after which other's hashes are no use
+			same_hash = KH_DictSameHash(self, other);
+		}
+		else if (!resolve || KH_DictExpired(self, index) || resolve(context, self->pairs[index].key, self->pairs[index].value, value)) {
+			KH_DictChange(self, index, value);
+			KH_ReleaseBlob(key);
+			
+			if (self->expiry) {
+				self->expiry[index] = expires;
+			}
+		}
+		else {
+			KH_ReleaseBlob(key);
+			KH_ReleaseBlob(value);
+		}
+	}
+	
+	// Everything in other belongs to self now
+	if (move) {
+		KH_DictForget(other);
+	}
+	
+	return true;
+}
+
+void KH_ReleaseDict(KH_Dict *dict) {
+	KH_FreeTable(dict, dict->slots);
+	
+	for (size_t i = dict->pairs_head; i < dict->pairs_used; i++) {
+		KH_ReleaseBlob(dict->pairs[i].key);
+		KH_ReleaseBlob(dict->pairs[i].value);
+	}
+	
+	KH_FreeTable(dict, dict->pairs);
+	KH_FreeTable(dict, dict->expiry);
+	
+	KH_Free(dict->allocator, dict);
+}
+
+void KH_DictClear(KH_Dict *self) {
+	/**
+	 * Remove every entry from the dict, keeping its memory so it can be
+	 * refilled without growing again.
+	 */
+	
+	for (size_t i = self->pairs_head; i < self->pairs_used; i++) {
+		KH_ReleaseBlob(self->pairs[i].key);
+		KH_ReleaseBlob(self->pairs[i].value);
+	}
+	
+	KH_DictForget(self);
+}
+
+bool KH_DictSet(KH_Dict *self, KH_Blob *key, KH_Blob *value) {
+	/**
+	 * Insert a (key, value) pair into the dictionary, overwriting any existing
+	 * one.
+	 */
+	
+	KH_STAT_BEGIN();
+	bool result = KH_DictUpsert(self, key, value, NULL) != NULL;
+	KH_STAT_END(KH_STAT_SET);
+	
+	return result;
+}
+
+bool KH_DictSetBytes(KH_Dict *self, const uint8_t *key, size_t key_length, const uint8_t *value, size_t value_length) {
+	/**
+	 * Set a (key, value) pair from plain buffers. When the key is new, both
+	 * blobs are created in one allocation; when it already exists, only the
+	 * new value is allocated.
+	 */
+	
+	KH_Blob lookup = { .data = key, .length = key_length };
+	kh_hash_t hash = KH_DictHashKey(self, &lookup);
+	size_t free_slot;
+	size_t index = KH_DictProbe(self, &lookup, hash, &free_slot);
+	
+	if (index != KH_NOT_FOUND) {
+		KH_Blob *new_value = KH_CreateBlobWith(self->allocator, value, value_length);
+		
+		if (!new_value) {
+			return false;
+		}
+		
+		KH_DictChange(self, index, new_value);
+		return true;
+	}
+	
+	KH_Blob *new_key = KH_CreateBlobPair(self->allocator, key, key_length, value, value_length);
+	
+	if (!new_key) {
+		return false;
+	}
+	
+	// Keep the blob hash from probing instead of computing it again
+	if (lookup.flags & KH_BLOB_HASHED) {
+		new_key->hash = lookup.hash;
+		new_key->flags |= lookup.flags & (KH_BLOB_HASHING | KH_BLOB_HASHED | KH_BLOB_HASH_CRC32C);
+	}
+	
+	if (!KH_DictInsert(self, new_key, new_key + 1, hash, free_slot)) {
+		KH_ReleaseBlob(new_key + 1);
+		KH_ReleaseBlob(new_key);
+		return false;
+	}
+	
+	return true;
+}
+
+KH_Blob **KH_DictGetOrInsert(KH_Dict *self, KH_Blob *key, KH_Blob *value, bool *inserted) {
+	/**
+	 * Return a pointer to the value for key, inserting (key, value) first if
+	 * the key doesn't exist yet. The table is only probed once either way.
+	 */
+	
+	kh_hash_t hash = KH_DictHashKey(self, key);
+	size_t free_slot;
+	size_t index = KH_DictProbe(self, key, hash, &free_slot);
+	
+	if (index == KH_NOT_FOUND) {
+		if (!KH_DictInsert(self, key, value, hash, free_slot)) {
+			KH_ReleaseBlob(key);
+			KH_ReleaseBlob(value);
+			return NULL;
+		}
+		
+		if (inserted) {
+			*inserted = true;
+		}
+		
+		return &self->pairs[self->pairs_used - 1].value;
+	}
+	
+	// An expired entry is as good as missing, so it takes the new value
+	else if (KH_DictExpired(self, index)) {
+		KH_DictChange(self, index, value);
+		KH_ReleaseBlob(key);
+		
+		if (inserted) {
+			*inserted = true;
+		}
+		
+		return &self->pairs[index].value;
+	}
+	else {
+		KH_ReleaseBlob(key);
+		KH_ReleaseBlob(value);
+		
+		if (inserted) {
+			*inserted = false;
+		}
+		
+		return &self->pairs[index].value;
+	}
+}
+
+static size_t KH_DictUpsertIndex(KH_Dict *self, KH_Blob *key, KH_Blob *value, bool *inserted) {
+	/**
+	 * Set the value for a key and return the index of its pair, or
+	 * KH_NOT_FOUND if it fails to allocate memory.
+	 */
+	
+	kh_hash_t hash = KH_DictHashKey(self, key);
+	size_t free_slot;
+	size_t index = KH_DictProbe(self, key, hash, &free_slot);
+	
+	if (index == KH_NOT_FOUND) {
+		if (!KH_DictInsert(self, key, value, hash, free_slot)) {
+			KH_ReleaseBlob(key);
+			KH_ReleaseBlob(value);
+			return KH_NOT_FOUND;
+		}
+		
+		if (inserted) {
+			*inserted = true;
+		}
+		
+		return self->pairs_used - 1;
+	}
+	else {
+		if (inserted) {
+			*inserted = KH_DictExpired(self, index);
+		}
+		
+		KH_DictChange(self, index, value);
+		KH_ReleaseBlob(key);
+		
+		return index;
+	}
+}
+
+KH_Blob **KH_DictUpsert(KH_Dict *self, KH_Blob *key, KH_Blob *value, bool *inserted) {
+	/**
+	 * Like KH_DictSet, but returns a pointer to the value and reports whether
+	 * the key was newly inserted.
+	 */
+	
+	size_t index = KH_DictUpsertIndex(self, key, value, inserted);
+	
+	return (index != KH_NOT_FOUND) ? &self->pairs[index].value : NULL;
+}
+
+KH_Blob *KH_DictGet(KH_Dict *self, KH_Blob *key) {
+	/**
+	 * Get a value blob by a key
+	 */
+	
+	KH_STAT_BEGIN();
+	size_t index = KH_DictLookupLive(self, key);
+	
+	KH_ReleaseBlob(key);
+	KH_STAT_END(KH_STAT_GET);
+	
+	if (index == KH_NOT_FOUND) {
+		return NULL;
+	}
+	else {
+		return self->pairs[index].value;
+	}
+}
+
+bool KH_DictHas(KH_Dict *self, KH_Blob *key) {
+	/**
+	 * Check if the dict has a pair with a given key
+	 */
+	
+	size_t index = KH_DictLookupLive(self, key);
+	KH_ReleaseBlob(key);
+	return index != KH_NOT_FOUND;
+}
+
+bool KH_DictDelete(KH_Dict *self, KH_Blob *key) {
+	/**
+	 * Delete a key-value pair by its key
+	 */
+	
+	KH_STAT_BEGIN();
+	size_t index = KH_DictLookupLive(self, key);
+	
+	if (index != KH_NOT_FOUND) {
+		KH_DictRemove(self, index);
+	}
+	
+	KH_ReleaseBlob(key);
+	KH_STAT_END(KH_STAT_DELETE);
+	
+	return index != KH_NOT_FOUND;
+}
+
+static bool KH_DictPop(KH_Dict *self, bool last, KH_Blob **key, KH_Blob **value) {
+	/**
+	 * Remove the oldest or newest entry, handing its key and value to the
+	 * caller (or releasing them if key or value is NULL). Expired entries
+	 * found at that end are removed on the way.
+	 */
+	
+	while (self->data_count) {
+		size_t index = last ? self->pairs_used - 1 : self->pairs_head;
+		
+		if (KH_DictExpired(self, index)) {
+			KH_DictRemove(self, index);
+			continue;
+		}
+		
+		KH_DictPair *pair = &self->pairs[index];
+		
+		if (key) {
+			*key = pair->key;
+			pair->key = NULL;
+		}
+		
+		if (value) {
+			*value = pair->value;
+			pair->value = NULL;
+		}
+		
+		// The slot is found by the stored hash, so the blobs can go first
+		KH_DictRemove(self, index);
+		
+		return true;
+	}
+	
+	return false;
+}
+
+bool KH_DictPopFirst(KH_Dict *self, KH_Blob **key, KH_Blob **value) {
+	/**
+	 * Remove the oldest entry in amortised O(1) time. Returns false if the
+	 * dict is empty.
+	 */
+	
+	return KH_DictPop(self, false, key, value);
+}
+
+bool KH_DictPopLast(KH_Dict *self, KH_Blob **key, KH_Blob **value) {
+	/**
+	 * Remove the newest entry in O(1) time. Returns false if the dict is
+	 * empty.
+	 */
+	
+	return KH_DictPop(self, true, key, value);
+}
+
+KH_Blob *KH_DictKeyIter(KH_Dict *self, size_t index) {
+	/**
+	 * Return the blob associated with the key at the given index. This can be
+	 * used to iterate all keys in the dict, with a return value of NULL
+	 * signaling the end of the dict.
+	 */
+	
+	// Indexes only mean anything once the holes left by deletes are closed
+	if (self->pairs_used != self->data_count) {
+		KH_RebuildSlots(self, false);
+	}
+	
+	return (index < self->data_count) ? self->pairs[index].key : NULL;
+}
+
+KH_Blob *KH_DictValueIter(KH_Dict *self, size_t index) {
+	/**
+	 * Return the blob associated with the value at the given index.
+	 */
+	
+	if (self->pairs_used != self->data_count) {
+		KH_RebuildSlots(self, false);
+	}
+	
+	return (index < self->data_count) ? self->pairs[index].value : NULL;
+}
+
+bool KH_DictShrinkToFit(KH_Dict *self) {
+	/**
+	 * Shrink the dict's memory to the smallest size that holds its current
+	 * entries.
+	 */
+	
+	return KH_ShrinkDict(self, self->data_count) != NULL;
+}
+
+size_t KH_DictLen(KH_Dict *self) {
+	/**
+	 * Return the number of key-value pairs in this dict
+	 */
+	
+	return self->data_count;
+}
+
+void KH_DictSetEventHooks(KH_Dict *self, KH_DictEventFunc before, KH_DictEventFunc after, void *context) {
+	/**
+	 * Set the functions called before and after the dict resizes or rebuilds
+	 * its slots. Either may be NULL.
+	 */
+	
+	self->before_event = before;
+	self->after_event = after;
+	self->event_context = context;
+}
+
+static size_t KH_SketchIndex(KH_Cache *self, kh_hash_t hash, int i) {
+	// The i-th of the four counters for a key. The hash is mixed first, since
+	// its low bits also pick the key's slot.
+	uint64_t mixed = hash * 0x9e3779b97f4a7c15ull;
+	uint64_t step = (mixed >> 32) | 1;
+	
+	return (size_t) ((mixed ^ (mixed >> 29)) + i * step) & (self->sketch_size - 1);
+}
+
+static uint32_t KH_SketchCounter(KH_Cache *self, size_t index) {
+	return (self->sketch[index / 16] >> (4 * (index % 16))) & 15;
+}
+
+static uint32_t KH_SketchEstimate(KH_Cache *self, kh_hash_t hash) {
+	/**
+	 * Estimate how often a key was used recently. This is a count-min sketch,
+	 * so the estimate can be too high when keys share counters but never too
+	 * low.
+	 */
+	
+	if (!self->sketch) {
+		return 0;
+	}
+	
+	uint32_t estimate = 15;
+	
+	for (int i = 0; i < 4; i++) {
+		uint32_t counter = KH_SketchCounter(self, KH_SketchIndex(self, hash, i));
+		estimate = (counter < estimate) ? counter : estimate;
+	}
+	
+	return estimate;
+}
+
+static void KH_SketchAdd(KH_Cache *self, kh_hash_t hash) {
+	/**
+	 * Count a use of a key. Only the key's lowest counters are increased,
+	 * which keeps other keys sharing them from being overestimated as much.
+	 * After ten uses per entry the sketch is sized for, all the counters are
+	 * halved so that keys which were only popular a long time ago are
+	 * forgotten.
+	 */
+	
+	if (!self->sketch) {
+		return;
+	}
+	
+	uint32_t estimate = KH_SketchEstimate(self, hash);
+	
+	if (estimate < 15) {
+		for (int i = 0; i < 4; i++) {
+			size_t index = KH_SketchIndex(self, hash, i);
+			
+			if (KH_SketchCounter(self, index) == estimate) {
+				self->sketch[index / 16] += (uint64_t) 1 << (4 * (index % 16));
+			}
+		}
+	}
+	
+	if (++self->sketch_additions >= 10 * (self->sketch_size / KH_SKETCH_COUNTERS)) {
+		for (size_t i = 0; i < self->sketch_size / 16; i++) {
+			self->sketch[i] = (self->sketch[i] >> 1) & 0x7777777777777777ull;
+		}
+		
+		self->sketch_additions /= 2;
+	}
+}
+
+static void KH_SketchReserve(KH_Cache *self, size_t count) {
+	/**
+	 * Make sure the sketch has KH_SKETCH_COUNTERS counters per entry, since
+	 * the many keys seen only once between halvings must not fill them up.
+	 * Caches limited by entries get theirs up front, but those only limited
+	 * by bytes have to grow it as they fill up, which starts the counts over.
+	 * If memory runs out, the old sketch is kept, and without one the cache
+	 * is plain LRU.
+	 */
+	
+	if (count * KH_SKETCH_COUNTERS <= self->sketch_size) {
+		return;
+	}
+	
+	size_t size = 64;
+	
+	while (size < count * KH_SKETCH_COUNTERS) {
+		size *= 2;
+	}
+	
+	uint64_t *sketch = KH_Alloc(self->dict->allocator, size / 2);
+	
+	if (!sketch) {
+		return;
+	}
+	
+	memset(sketch, 0, size / 2);
+	KH_Free(self->dict->allocator, self->sketch);
+	self->sketch = sketch;
+	self->sketch_size = size;
+	self->sketch_additions = 0;
+}
+
+static size_t KH_CacheVictim(KH_Cache *self) {
+	/**
+	 * Pick the entry to evict. An LRU cache evicts the least recently used
+	 * one; with KH_CACHE_TINY_LFU, it's the least frequently used of the
+	 * KH_CACHE_SAMPLES least recently used ones, so keys seen once in a scan
+	 * go before old but popular ones.
+	 */
+	
+	KH_Dict *dict = self->dict;
+	size_t victim = dict->pairs_head;
+	
+	if (!self->sketch) {
+		return victim;
+	}
+	
+	uint32_t lowest = KH_SketchEstimate(self, dict->pairs[victim].hash);
+	size_t seen = 1;
+	
+	for (size_t i = victim + 1; i < dict->pairs_used && seen < KH_CACHE_SAMPLES && lowest; i++) {
+		if (!dict->pairs[i].key) {
+			continue;
+		}
+		
+		uint32_t estimate = KH_SketchEstimate(self, dict->pairs[i].hash);
+		
+		if (estimate < lowest) {
+			lowest = estimate;
+			victim = i;
+		}
+		
+		seen++;
+	}
+	
+	return victim;
+}
+
+uint64_t KH_Now(void) {
+	/**
+	 * The clock expiry times are measured on, in nanoseconds. It has no
+	 * particular starting point, and only ever goes forward unless it had to
+	 * fall back to wall clock time.
+	 */
+	
+	return KH_Nanoseconds();
+}
+
+bool KH_DictSetExpiring(KH_Dict *self, KH_Blob *key, KH_Blob *value, uint64_t expires) {
+	/**
+	 * Like KH_DictSet, but the entry expires at the given KH_Now() time, or
+	 * never if it's zero.
+	 */
+	
+	if (expires && !KH_DictEnableExpiry(self)) {
+		KH_ReleaseBlob(key);
+		KH_ReleaseBlob(value);
+		return false;
+	}
+	
+	size_t index = KH_DictUpsertIndex(self, key, value, NULL);
+	
+	if (index == KH_NOT_FOUND) {
+		return false;
+	}
+	
+	if (self->expiry) {
+		self->expiry[index] = expires;
+	}
+	
+	return true;
+}
+
+bool KH_DictExpire(KH_Dict *self, KH_Blob *key, uint64_t expires) {
+	/**
+	 * Make an existing entry expire at the given KH_Now() time, or never if
+	 * it's zero. Returns false if the key isn't there (or has already
+	 * expired), or if memory for the expiry times can't be allocated.
+	 */
+	
+	size_t index = KH_DictLookupLive(self, key);
+	
+	KH_ReleaseBlob(key);
+	
+	if (index == KH_NOT_FOUND || (expires && !KH_DictEnableExpiry(self))) {
+		return false;
+	}
+	
+	if (self->expiry) {
+		self->expiry[index] = expires;
+	}
+	
+	return true;
+}
+
+size_t KH_DictSweep(KH_Dict *self, size_t budget) {
+	/**
+	 * Remove expired entries, looking at no more than budget pairs. Each call
+	 * carries on from where the last one stopped, so calling this regularly
+	 * with a small budget reclaims them all without ever stalling for long.
+	 * Returns the number of entries removed.
+	 */
+	
+	if (!self->expiry) {
+		return 0;
+	}
+	
+	uint64_t now = KH_Nanoseconds();
+	size_t removed = 0;
+	
+	for (size_t i = 0; i < budget && self->data_count; i++) {
+		if (self->sweep_next < self->pairs_head || self->sweep_next >= self->pairs_used) {
+			self->sweep_next = self->pairs_head;
+		}
+		
+		size_t index = self->sweep_next;
+		
+		if (self->expiry[index] && self->expiry[index] <= now) {
+			KH_DictRemove(self, index);
+			removed++;
+			
+			// Tiny dicts move the next pair down into this one
+			if (!self->slots) {
+				continue;
+			}
+		}
+		
+		self->sweep_next++;
+	}
+	
+	return removed;
+}
+
+KH_Cache *KH_CreateCache(const KH_CacheOptions *options) {
+	/**
+	 * Create a cache which evicts its least recently used entries to stay
+	 * within the limits in options.
+	 */
+	
+	const KH_Allocator *allocator = options ? options->dict.allocator : NULL;
+	KH_Cache *cache = KH_Alloc(allocator, sizeof *cache);
+	
+	if (!cache) {
+		return NULL;
+	}
+	
+	memset(cache, 0, sizeof *cache);
+	cache->dict = KH_CreateDictWithOptions(options ? &options->dict : NULL);
+	
+	if (!cache->dict) {
+		KH_Free(allocator, cache);
+		return NULL;
+	}
+	
+	if (options) {
+		cache->max_entries = options->max_entries;
+		cache->max_bytes = options->max_bytes;
+		cache->flags = options->flags;
+	}
+	
+	if (cache->flags & KH_CACHE_TINY_LFU) {
+		KH_SketchReserve(cache, cache->max_entries);
+	}
+	
+	return cache;
+}
 
-static size_t KH_DictLookupIndex(KH_Dict *self, KH_Blob *key) {
+void KH_ReleaseCache(KH_Cache *self) {
+	const KH_Allocator *allocator = self->dict->allocator;
+	KH_ReleaseDict(self->dict);
+	KH_Free(allocator, self->sketch);
+	KH_Free(allocator, self);
+}
+
+static size_t KH_CacheEntrySize(KH_Blob *key, KH_Blob *value) {
+	return key->length + (value ? value->length : 0);
+}
+
+static bool KH_CacheOverBudget(KH_Cache *self, size_t count, size_t bytes) {
+	return (self->max_entries && count > self->max_entries) || (self->max_bytes && bytes > self->max_bytes);
+}
+
+static void KH_CacheRemove(KH_Cache *self, size_t index) {
+	KH_DictPair *pair = &self->dict->pairs[index];
+	self->bytes -= KH_CacheEntrySize(pair->key, pair->value);
+	KH_DictRemove(self->dict, index);
+}
+
+bool KH_CacheSet(KH_Cache *self, KH_Blob *key, KH_Blob *value) {
 	/**
-	 * Find the index of a pair given its key. Returns the index or KH_NOT_FOUND
-	 * if none was found.
+	 * Set the value for a key and make it the most recently used entry,
+	 * evicting the least recently used ones if the cache goes over its
+	 * limits. The oldest entry is always at the head of the pairs, so each
+	 * eviction is O(1).
 	 */
 	
-	uint32_t slot_index = KH_BlobStartingIndexForSize(key->hash, self->data_alloced);
+	KH_Dict *dict = self->dict;
+	size_t size = KH_CacheEntrySize(key, value);
 	
-	for (size_t i = 0; i < self->data_alloced; i++) {
-		KH_Slot slot = self->slots[(slot_index + i) & (self->data_alloced - 1)];
+	// An entry that can never fit isn't stored, and doesn't push everything
+	// else out trying. Any old value for the key is out of date now.
+	if (self->max_bytes && size > self->max_bytes) {
+		KH_CacheDelete(self, key);
+		KH_ReleaseBlob(value);
+		return false;
+	}
+	
+	kh_hash_t hash = KH_DictHashKey(dict, key);
+	size_t free_slot;
+	size_t index = KH_DictProbe(dict, key, hash, &free_slot);
+	
+	KH_SketchAdd(self, hash);
+	
+	if (index != KH_NOT_FOUND) {
+		self->bytes -= KH_CacheEntrySize(dict->pairs[index].key, dict->pairs[index].value);
+		self->bytes += size;
+		KH_DictChange(dict, index, value);
+		KH_ReleaseBlob(key);
+		KH_DictPromote(dict, index);
 		
-		// Empty, never-used slot which won't have anything we're looking for
-		// located after it
-		if (slot == KH_HASH_EMPTY) {
-			break;
+		while (KH_CacheOverBudget(self, dict->data_count, self->bytes)) {
+			KH_CacheRemove(self, dict->pairs_head);
 		}
 		
-		// Once used slot which may still have hits after it
-		if (slot == KH_HASH_DELETED) {
-			continue;
+		return true;
+	}
+	
+	// Evict before inserting, so the dict doesn't grow past the limit just
+	// to shrink back. With KH_CACHE_TINY_LFU, a new key is only let in if it
+	// has been used more often than each entry it would push out, which keeps
+	// scans from flushing the cache.
+	while (dict->data_count && KH_CacheOverBudget(self, dict->data_count + 1, self->bytes + size)) {
+		size_t victim = KH_CacheVictim(self);
+		bool admit = !self->sketch || KH_SketchEstimate(self, hash) > KH_SketchEstimate(self, dict->pairs[victim].hash);
+		
+		// When the oldest entry survives, send it to the back, or the same
+		// few entries would be compared against every new key and the ones
+		// behind them would never be looked at. This is decided before any
+		// removal, which would move the head on to an entry never compared.
+		bool rotate = self->sketch && victim != dict->pairs_head;
+		
+		if (admit) {
+			KH_CacheRemove(self, victim);
+			free_slot = KH_NOT_FOUND;
 		}
 		
-		// If the key we're looking up matches the key indexed by the current
-		// slot, this is a hit and it should be returned.
-		if (KH_BlobEqual(key, self->pairs[slot].key)) {
-			return slot;
+		if (rotate) {
+			KH_DictPromote(dict, dict->pairs_head);
+			free_slot = KH_NOT_FOUND;
+		}
+		
+		if (!admit) {
+			KH_ReleaseBlob(key);
+			KH_ReleaseBlob(value);
+			return false;
 		}
 	}
 	
-	// print_slots(self);
+	if (!KH_DictInsert(dict, key, value, hash, free_slot)) {
+		KH_ReleaseBlob(key);
+		KH_ReleaseBlob(value);
+		return false;
+	}
 	
-	return KH_NOT_FOUND;
+	self->bytes += size;
+	
+	if (self->flags & KH_CACHE_TINY_LFU) {
+		KH_SketchReserve(self, dict->data_count);
+	}
+	
+	return true;
 }
 
-static void KH_DictRemove(KH_Dict *self, size_t index) {
+KH_Blob *KH_CacheGet(KH_Cache *self, KH_Blob *key) {
 	/**
-	 * Deletes the value at the given index, and updates the slots as needed.
+	 * Get the value for a key, or NULL if it isn't cached. With
+	 * KH_CACHE_PROMOTE_ON_GET, a hit becomes the most recently used entry.
+	 * With KH_CACHE_TINY_LFU, hits and misses both count as uses of the key.
 	 */
 	
-	// Free key and value, they arent needed anymore
-	free(self->pairs[index].key);
-	free(self->pairs[index].value);
+	kh_hash_t hash = KH_DictHashKey(self->dict, key);
+	size_t index = KH_DictProbe(self->dict, key, hash, NULL);
+	
+	KH_SketchAdd(self, hash);
+	KH_ReleaseBlob(key);
 	
-	// Move pairs to lower indexes
-	// memmove(&self->pairs[index], &self->pairs[index + 1], (size_t)&self->pairs[index + 1] - (size_t)&self->pairs[self->data_count]);
-	for (size_t i = index + 1; i < self->data_count; i++) {
-		self->pairs[i - 1] = self->pairs[i];
+	if (index == KH_NOT_FOUND) {
+		return NULL;
 	}
 	
-	self->data_count--;
+	if (self->flags & KH_CACHE_PROMOTE_ON_GET) {
+		index = KH_DictPromote(self->dict, index);
+	}
 	
-	// Fix up the slots
-	for (size_t i = 0; i < self->data_alloced; i++) {
-		// If its already deleted or empty then no fixup should be needed
-		if (self->slots[i] == KH_HASH_DELETED || self->slots[i] == KH_HASH_EMPTY) {
-			continue;
-		}
+	return self->dict->pairs[index].value;
+}
+
+bool KH_CacheDelete(KH_Cache *self, KH_Blob *key) {
+	/**
+	 * Remove a key from the cache, returning whether it was there.
+	 */
+	
+	size_t index = KH_DictLookupIndex(self->dict, key);
+	
+	KH_ReleaseBlob(key);
+	
+	if (index == KH_NOT_FOUND) {
+		return false;
+	}
+	
+	KH_CacheRemove(self, index);
+	
+	return true;
+}
+
+size_t KH_CacheLen(KH_Cache *self) {
+	return self->dict->data_count;
+}
+
+static KH_Set *KH_WrapSet(KH_Dict *dict) {
+	if (!dict) {
+		return NULL;
+	}
+	
+	KH_Set *set = KH_Alloc(dict->allocator, sizeof *set);
+	
+	if (!set) {
+		KH_ReleaseDict(dict);
+		return NULL;
+	}
+	
+	set->dict = dict;
+	
+	return set;
+}
+
+KH_Set *KH_CreateSet(const KH_DictOptions *options) {
+	/**
+	 * Create a set of keys. It's a dict whose values are all NULL, so no
+	 * blobs are made or kept for them.
+	 */
+	
+	return KH_WrapSet(KH_CreateDictWithOptions(options));
+}
+
+KH_Set *KH_SetClone(KH_Set *self) {
+	return KH_WrapSet(KH_DictClone(self->dict));
+}
+
+void KH_ReleaseSet(KH_Set *self) {
+	const KH_Allocator *allocator = self->dict->allocator;
+	KH_ReleaseDict(self->dict);
+	KH_Free(allocator, self);
+}
+
+bool KH_SetAdd(KH_Set *self, KH_Blob *key, bool *added) {
+	/**
+	 * Add a key to the set, reporting whether it wasn't there already.
+	 * Returns false if it fails to allocate memory.
+	 */
+	
+	return KH_DictGetOrInsert(self->dict, key, NULL, added) != NULL;
+}
+
+bool KH_SetHas(KH_Set *self, KH_Blob *key) {
+	return KH_DictHas(self->dict, key);
+}
+
+bool KH_SetDelete(KH_Set *self, KH_Blob *key) {
+	return KH_DictDelete(self->dict, key);
+}
+
+KH_Blob *KH_SetIter(KH_Set *self, size_t index) {
+	return KH_DictKeyIter(self->dict, index);
+}
+
+size_t KH_SetLen(KH_Set *self) {
+	return self->dict->data_count;
+}
+
+bool KH_SetUnion(KH_Set *self, KH_Set *other) {
+	/**
+	 * Add every key in other to self. Returns false if it fails to allocate
+	 * memory, in which case self is left as it was.
+	 */
+	
+	return KH_DictUpdate(self->dict, other->dict, false, NULL, NULL);
+}
+
+static void KH_SetFilter(KH_Set *self, KH_Set *other, bool keep_common) {
+	/**
+	 * Remove the keys of self which are (or with keep_common, aren't) in
+	 * other. Each key is looked up in other by its stored hash when both
+	 * hash keys the same way, so no key is hashed again.
+	 */
+	
+	KH_Dict *dict = self->dict;
+	bool same_hash = KH_DictSameHash(dict, other->dict);
+	uint32_t flags = dict->flags;
+	
+	// Shrinking would move the pairs around while they're being walked, so
+	// it's held off until the end
+	dict->flags &= ~KH_DICT_AUTO_SHRINK;
+	
+	for (size_t i = dict->pairs_head; i < dict->pairs_used;) {
+		KH_DictPair *pair = &dict->pairs[i];
 		
-		// If it's greater than the current index we need to decrement one
-		else if (self->slots[i] > index) {
-			self->slots[i] -= 1;
+		if (pair->key) {
+			kh_hash_t hash = same_hash ? pair->hash : KH_DictHashKey(other->dict, pair->key);
+			bool common = KH_DictProbe(other->dict, pair->key, hash, NULL) != KH_NOT_FOUND;
+			
+			if (common != keep_common) {
+				KH_DictRemove(dict, i);
+				
+				// Tiny dicts move the next pair down into this one
+				if (!dict->slots) {
+					continue;
+				}
+			}
 		}
 		
-		// If it's the index we deleted we need to mark it deleted
-		else if (self->slots[i] == index) {
-			self->slots[i] = KH_HASH_DELETED;
+		i++;
+	}
+	
+	dict->flags = flags;
+	
+	if ((flags & KH_DICT_AUTO_SHRINK) && dict->slots && dict->data_count < dict->pairs_alloced / 4) {
+		KH_ShrinkDict(dict, 2 * dict->data_count);
+	}
+}
+
+void KH_SetIntersection(KH_Set *self, KH_Set *other) {
+	/**
+	 * Remove every key of self which isn't in other.
+	 */
+	
+	if (self != other) {
+		KH_SetFilter(self, other, true);
+	}
+}
+
+void KH_SetDifference(KH_Set *self, KH_Set *other) {
+	/**
+	 * Remove every key of self which is in other. Whichever set is smaller
+	 * is walked and looked up in the other one.
+	 */
+	
+	if (self == other) {
+		KH_DictClear(self->dict);
+		return;
+	}
+	
+	if (self->dict->data_count <= other->dict->data_count) {
+		KH_SetFilter(self, other, false);
+		return;
+	}
+	
+	KH_Dict *dict = self->dict;
+	bool same_hash = KH_DictSameHash(dict, other->dict);
+	
+	for (size_t i = other->dict->pairs_head; i < other->dict->pairs_used && dict->data_count; i++) {
+		KH_Blob *key = other->dict->pairs[i].key;
+		
+		if (!key) {
+			continue;
 		}
 		
-		// The other case (slot is less than index) requires no action
-		else {
+		kh_hash_t hash = same_hash ? other->dict->pairs[i].hash : KH_DictHashKey(dict, key);
+		size_t index = KH_DictProbe(dict, key, hash, NULL);
+		
+		if (index != KH_NOT_FOUND) {
+			KH_DictRemove(dict, index);
 		}
 	}
 }
 
-KH_Dict *KH_CreateDict(void) {
-	KH_Dict *dict = malloc(sizeof *dict);
-	memset(dict, 0, sizeof *dict);
-	return dict;
+KH_MultiDict *KH_CreateMultiDict(const KH_DictOptions *options) {
+	/**
+	 * Create a dict mapping each key to a list of values.
+	 */
+	
+	const KH_Allocator *allocator = options ? options->allocator : NULL;
+	KH_MultiDict *multi = KH_Alloc(allocator, sizeof *multi);
+	
+	if (!multi) {
+		return NULL;
+	}
+	
+	multi->dict = KH_CreateDictWithOptions(options);
+	multi->value_count = 0;
+	
+	if (!multi->dict) {
+		KH_Free(allocator, multi);
+		return NULL;
+	}
+	
+	return multi;
 }
 
-void KH_ReleaseDict(KH_Dict *dict) {
-	free(dict->slots);
+void KH_ReleaseMultiDict(KH_MultiDict *self) {
+	const KH_Allocator *allocator = self->dict->allocator;
+	KH_ReleaseDict(self->dict);
+	KH_Free(allocator, self);
+}
+
+typedef struct KH_MultiList {
+	const KH_Allocator *allocator;
+	KH_Blob **values;
+	size_t count;
+	size_t alloced;
+} KH_MultiList;
+
+static KH_MultiList *KH_MultiListOf(KH_Blob *blob) {
+	return ((KH_BlobView *) blob)->context;
+}
+
+static void KH_MultiListRelease(void *context, const uint8_t *data, size_t length) {
+	KH_MultiList *list = context;
+	(void) data;
+	(void) length;
 	
-	for (size_t i = 0; i < dict->data_count; i++) {
-		free(dict->pairs[i].key);
-		free(dict->pairs[i].value);
+	for (size_t i = 0; i < list->count; i++) {
+		KH_ReleaseBlob(list->values[i]);
 	}
 	
-	free(dict->pairs);
-	
-	free(dict);
+	KH_Free(list->allocator, list->values);
+	KH_Free(list->allocator, list);
 }
 
-bool KH_DictSet(KH_Dict *self, KH_Blob *key, KH_Blob *value) {
+static KH_Blob *KH_MultiListCreate(const KH_Allocator *allocator) {
 	/**
-	 * Insert a (key, value) pair into the dictionary, overwriting any existing
-	 * one.
+	 * Create an empty list of values. The list is kept behind an empty view
+	 * blob rather than in it, so adding values never changes the blob itself.
 	 */
 	
-	size_t index = KH_DictLookupIndex(self, key);
+	KH_MultiList *list = KH_Alloc(allocator, sizeof *list);
 	
-	if (index == KH_NOT_FOUND) {
-		return KH_DictInsert(self, key, value);
+	if (!list) {
+		return NULL;
 	}
-	else {
-		KH_DictChange(self, index, value);
-		free(key);
-		return true;
+	
+	list->allocator = allocator;
+	list->values = KH_Alloc(allocator, sizeof *list->values * KH_MULTI_MIN_VALUES);
+	list->count = 0;
+	list->alloced = KH_MULTI_MIN_VALUES;
+	
+	if (!list->values) {
+		KH_Free(allocator, list);
+		return NULL;
+	}
+	
+	KH_Blob *blob = KH_CreateBlobViewWith(allocator, NULL, 0, KH_MultiListRelease, list);
+	
+	if (!blob) {
+		KH_Free(allocator, list->values);
+		KH_Free(allocator, list);
 	}
+	
+	return blob;
 }
 
-KH_Blob *KH_DictGet(KH_Dict *self, KH_Blob *key) {
+bool KH_MultiDictAdd(KH_MultiDict *self, KH_Blob *key, KH_Blob *value) {
 	/**
-	 * Get a value blob by a key
+	 * Append a value to the ones for key. The values are kept in an array
+	 * which doubles in size when it's full, so appending is amortised O(1)
+	 * and never touches the values already there. Returns false if it fails
+	 * to allocate memory.
 	 */
 	
-	size_t index = KH_DictLookupIndex(self, key);
+	KH_Dict *dict = self->dict;
+	bool inserted;
+	KH_Blob **entry = KH_DictGetOrInsert(dict, key, NULL, &inserted);
 	
-	free(key);
+	if (!entry) {
+		KH_ReleaseBlob(value);
+		return false;
+	}
 	
-	if (index == KH_NOT_FOUND) {
-		return NULL;
+	if (inserted) {
+		*entry = KH_MultiListCreate(dict->allocator);
+		
+		// Take the key back out rather than leave it without a list
+		if (!*entry) {
+			KH_DictRemove(dict, dict->pairs_used - 1);
+			KH_ReleaseBlob(value);
+			return false;
+		}
 	}
-	else {
-		return self->pairs[index].value;
+	
+	KH_MultiList *list = KH_MultiListOf(*entry);
+	
+	if (list->count == list->alloced) {
+		KH_Blob **values = KH_Realloc(dict->allocator, list->values, sizeof value * 2 * list->alloced);
+		
+		if (!values) {
+			KH_ReleaseBlob(value);
+			return false;
+		}
+		
+		list->values = values;
+		list->alloced *= 2;
 	}
+	
+	list->values[list->count++] = value;
+	self->value_count++;
+	
+	return true;
 }
 
-bool KH_DictHas(KH_Dict *self, KH_Blob *key) {
+KH_Blob **KH_MultiDictGet(KH_MultiDict *self, KH_Blob *key, size_t *count) {
 	/**
-	 * Check if the dict has a pair with a given key
+	 * Return the values for key in the order they were added and set count
+	 * to how many there are, or return NULL with count set to zero if the
+	 * key isn't there.
 	 */
 	
-	size_t index = KH_DictLookupIndex(self, key);
-	free(key);
-	return index != KH_NOT_FOUND;
+	KH_Blob *list = KH_DictGet(self->dict, key);
+	
+	*count = list ? KH_MultiListOf(list)->count : 0;
+	
+	return list ? KH_MultiListOf(list)->values : NULL;
 }
 
-bool KH_DictDelete(KH_Dict *self, KH_Blob *key) {
+bool KH_MultiDictDelete(KH_MultiDict *self, KH_Blob *key) {
 	/**
-	 * Delete a key-value pair by its key
+	 * Remove a key along with all of its values.
 	 */
 	
-	size_t index = KH_DictLookupIndex(self, key);
+	size_t index = KH_DictLookupIndex(self->dict, key);
+	
+	KH_ReleaseBlob(key);
 	
 	if (index == KH_NOT_FOUND) {
-		free(key);
 		return false;
 	}
-	else {
-		KH_DictRemove(self, index);
-		free(key);
-		return true;
-	}
+	
+	self->value_count -= KH_MultiListOf(self->dict->pairs[index].value)->count;
+	KH_DictRemove(self->dict, index);
+	
+	return true;
 }
 
-KH_Blob *KH_DictKeyIter(KH_Dict *self, size_t index) {
+KH_Blob *KH_MultiDictKeyIter(KH_MultiDict *self, size_t index) {
+	return KH_DictKeyIter(self->dict, index);
+}
+
+KH_Blob **KH_MultiDictValuesIter(KH_MultiDict *self, size_t index, size_t *count) {
 	/**
-	 * Return the blob associated with the key at the given index. This can be
-	 * used to iterate all keys in the dict, with a return value of NULL
-	 * signaling the end of the dict.
+	 * Return the values for the i-th key like KH_MultiDictGet, or NULL if it
+	 * would be out of bounds.
 	 */
 	
-	return (index < self->data_count) ? self->pairs[index].key : NULL;
+	KH_Blob *list = KH_DictValueIter(self->dict, index);
+	
+	*count = list ? KH_MultiListOf(list)->count : 0;
+	
+	return list ? KH_MultiListOf(list)->values : NULL;
 }
 
-KH_Blob *KH_DictValueIter(KH_Dict *self, size_t index) {
+size_t KH_MultiDictLen(KH_MultiDict *self) {
+	return self->dict->data_count;
+}
+
+bool KH_GetLatencyHistogram(int op, KH_Histogram *histogram) {
 	/**
-	 * Return the blob associated with the value at the given index.
+	 * Copy the latency histogram for one of the KH_STAT_* operations. Returns
+	 * false, with an empty histogram, if stats weren't compiled in.
 	 */
 	
-	return (index < self->data_count) ? self->pairs[index].value : NULL;
+	memset(histogram, 0, sizeof *histogram);
+	
+#ifdef KHASHTABLE_STATS
+	if (op < 0 || op >= KH_STAT_COUNT) {
+		return false;
+	}
+	
+	const uint64_t *from = (const uint64_t *) &KH_LatencyHistograms[op];
+	uint64_t *to = (uint64_t *) histogram;
+	
+	for (size_t i = 0; i < sizeof *histogram / sizeof *to; i++) {
+#ifdef __GNUC__
+		to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+#else
+		to[i] = from[i];
+#endif
+	}
+	
+	return true;
+#else
+	(void) op;
+	return false;
+#endif
 }
 
-size_t KH_DictLen(KH_Dict *self) {
+void KH_ResetLatencyHistograms(void) {
 	/**
-	 * Return the number of key-value pairs in this dict
+	 * Empty all latency histograms.
 	 */
 	
-	return self->data_count;
+#ifdef KHASHTABLE_STATS
+	uint64_t *counter = (uint64_t *) KH_LatencyHistograms;
+	
+	for (size_t i = 0; i < KH_STAT_COUNT * sizeof (KH_Histogram) / sizeof *counter; i++) {
+#ifdef __GNUC__
+		__atomic_store_n(&counter[i], 0, __ATOMIC_RELAXED);
+#else
+		counter[i] = 0;
+#endif
+	}
+#endif
+}
+
+uint64_t KH_HistogramPercentile(const KH_Histogram *histogram, double percentile) {
+	/**
+	 * Return the latency in nanoseconds that the given percentage of the
+	 * recorded operations took at most, rounded up to the end of its bucket.
+	 */
+	
+	if (!histogram->total) {
+		return 0;
+	}
+	
+	double wanted = percentile / 100.0 * (double) histogram->total;
+	uint64_t rank = (uint64_t) wanted;
+	
+	if (rank < wanted || rank == 0) {
+		rank++;
+	}
+	
+	uint64_t seen = 0;
+	
+	for (size_t i = 0; i < KH_HISTOGRAM_BUCKETS - 1; i++) {
+		seen += histogram->counts[i];
+		
+		if (seen >= rank) {
+			uint64_t limit = KH_HistogramBucketStart(i + 1) - 1;
+			return (limit < histogram->max) ? limit : histogram->max;
+		}
+	}
+	
+	return histogram->max;
 }
 #endif // KHASHTABLE_IMPLEMENTATION
 
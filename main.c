@@ -15,7 +15,7 @@ void print_dict(KH_Dict *dict) {
 void print_slots(KH_Dict *dict) {
 	printf("Slots (%zu)\n", dict->data_alloced);
 	for (size_t i = 0; i < dict->data_alloced; i++) {
-		printf("  - [0x%zx] 0x%08x\n", i, dict->slots[i]);
+		printf("  - [0x%zx] 0x%zx\n", i, KH_GetSlot(dict->slots, dict->slot_size, i));
 	}
 }
 